@@ -0,0 +1,243 @@
+/* Asynchronous payload logging for -l.
+ *
+ * The event loop copies logged bytes into one of ALOG_NBUFS large
+ * buffers and hands full ones to a writer thread through a
+ * single-producer/single-consumer ring, so the data path never makes a
+ * system call to log.  If the disk falls behind and every buffer is in
+ * flight, alog_write waits at most ALOG_STALL_NS for the writer and
+ * then drops (and counts) bytes until a buffer comes back.
+ *
+ * With direct set the file is opened O_DIRECT, bypassing the page
+ * cache; buffers are page-aligned and only full buffers are written
+ * until the final flush. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+#define ALOG_NBUFS 8
+#define ALOG_BUFSIZE (1 << 20)
+#define ALOG_ALIGN 4096
+#define ALOG_STALL_NS 1000000
+
+struct alog {
+  int fd;
+  int direct;
+  char *bufs[ALOG_NBUFS];
+  size_t lens[ALOG_NBUFS];
+  _Atomic uint64_t head;	/* buffers handed to the writer */
+  _Atomic uint64_t tail;	/* buffers the writer has finished */
+  size_t fill;			/* bytes in bufs[head % ALOG_NBUFS] */
+  int nobuf;			/* ring full: dropping until one frees */
+  uint64_t dropped;		/* bytes not logged */
+  sem_t ready;			/* posted per buffer handed over */
+  sem_t space;			/* posted per buffer finished */
+  int closing;
+  pthread_t thread;
+};
+
+static void
+alog_writeall (struct alog *l, const char *buf, size_t n)
+{
+  if (l->direct && n % ALOG_ALIGN) {
+    /* Only the last flush can be ragged; finish it through the page
+     * cache, since O_DIRECT needs whole blocks. */
+    fcntl (l->fd, F_SETFL, fcntl (l->fd, F_GETFL) & ~O_DIRECT);
+    l->direct = 0;
+  }
+  while (n > 0) {
+    ssize_t r = write (l->fd, buf, n);
+    if (r < 0) {
+      if (errno == EINTR)
+	continue;
+      perror ("log write");
+      return;
+    }
+    buf += r;
+    n -= r;
+  }
+}
+
+static void *
+alog_writer (void *arg)
+{
+  struct alog *l = arg;
+
+  for (;;) {
+    uint64_t tail;
+    while (sem_wait (&l->ready) < 0 && errno == EINTR)
+      ;
+    tail = atomic_load_explicit (&l->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit (&l->head, memory_order_acquire)) {
+      if (l->closing)
+	return NULL;
+      continue;
+    }
+    alog_writeall (l, l->bufs[tail % ALOG_NBUFS], l->lens[tail % ALOG_NBUFS]);
+    atomic_store_explicit (&l->tail, tail + 1, memory_order_release);
+    sem_post (&l->space);
+  }
+}
+
+struct alog *
+alog_open (const char *name, int direct)
+{
+  struct alog *l;
+  int i, flags = O_CREAT | O_TRUNC | O_WRONLY;
+
+  l = xmalloc (sizeof (*l));
+  memset (l, 0, sizeof (*l));
+  l->direct = direct;
+  if ((l->fd = open (name, flags | (direct ? O_DIRECT : 0), 0666)) < 0
+      && direct) {
+    /* e.g. tmpfs, which has no O_DIRECT */
+    l->direct = 0;
+    l->fd = open (name, flags, 0666);
+  }
+  if (l->fd < 0) {
+    perror (name);
+    free (l);
+    return NULL;
+  }
+
+  for (i = 0; i < ALOG_NBUFS; i++)
+    if (posix_memalign ((void **) &l->bufs[i], ALOG_ALIGN, ALOG_BUFSIZE)) {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      abort ();
+    }
+  sem_init (&l->ready, 0, 0);
+  sem_init (&l->space, 0, 0);
+  if ((errno = pthread_create (&l->thread, NULL, alog_writer, l))) {
+    perror ("pthread_create");
+    abort ();
+  }
+  return l;
+}
+
+/* Hands the current buffer to the writer. */
+static void
+alog_publish (struct alog *l)
+{
+  uint64_t head = atomic_load_explicit (&l->head, memory_order_relaxed);
+
+  l->lens[head % ALOG_NBUFS] = l->fill;
+  atomic_store_explicit (&l->head, head + 1, memory_order_release);
+  sem_post (&l->ready);
+  l->fill = 0;
+}
+
+/* Returns non-zero if bufs[head] is free to fill, waiting up to
+ * ALOG_STALL_NS for the writer if it is not. */
+static int
+alog_havebuf (struct alog *l, int wait)
+{
+  uint64_t head = atomic_load_explicit (&l->head, memory_order_relaxed);
+  struct timespec ts;
+
+  if (head - atomic_load_explicit (&l->tail, memory_order_acquire)
+      < ALOG_NBUFS)
+    return 1;
+  if (!wait)
+    return 0;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_nsec += ALOG_STALL_NS;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  while (head - atomic_load_explicit (&l->tail, memory_order_acquire)
+	 >= ALOG_NBUFS)
+    if (sem_timedwait (&l->space, &ts) < 0 && errno != EINTR)
+      return 0;
+  return 1;
+}
+
+void
+alog_write (struct alog *l, const void *_buf, size_t n)
+{
+  const char *buf = _buf;
+
+  if (l->nobuf) {
+    if (!alog_havebuf (l, 0)) {
+      l->dropped += n;
+      return;
+    }
+    l->nobuf = 0;
+  }
+
+  while (n > 0) {
+    size_t k = ALOG_BUFSIZE - l->fill;
+    if (k > n)
+      k = n;
+    memcpy (l->bufs[atomic_load_explicit (&l->head, memory_order_relaxed)
+		    % ALOG_NBUFS] + l->fill, buf, k);
+    l->fill += k;
+    buf += k;
+    n -= k;
+    if (l->fill == ALOG_BUFSIZE) {
+      alog_publish (l);
+      if (!alog_havebuf (l, 1)) {
+	l->nobuf = 1;
+	l->dropped += n;
+	return;
+      }
+    }
+  }
+}
+
+/* Called from the timer: pushes out a partly filled buffer so the log
+ * trails the data by at most one tick.  O_DIRECT logs keep filling
+ * whole buffers instead. */
+void
+alog_flush (struct alog *l)
+{
+  if (l->fill && !l->direct && !l->nobuf && alog_havebuf (l, 0)) {
+    alog_publish (l);
+    l->nobuf = !alog_havebuf (l, 0);
+  }
+}
+
+int
+alog_pending (const struct alog *l)
+{
+  return l->fill && !l->direct;
+}
+
+uint64_t
+alog_dropped (const struct alog *l)
+{
+  return l->dropped;
+}
+
+void
+alog_close (struct alog *l)
+{
+  int i;
+
+  if (l->fill && (!l->nobuf || alog_havebuf (l, 1)))
+    alog_publish (l);
+  l->closing = 1;
+  sem_post (&l->ready);
+  pthread_join (l->thread, NULL);
+  if (l->dropped)
+    fprintf (stderr, "%s: log dropped %llu bytes\n", progname,
+	     (unsigned long long) l->dropped);
+  close (l->fd);
+  for (i = 0; i < ALOG_NBUFS; i++)
+    free (l->bufs[i]);
+  sem_destroy (&l->ready);
+  sem_destroy (&l->space);
+  free (l);
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# Lossy close test.  Runs CLOSE_RUNS short transfers at once, each
+# between two stand-alone reliable processes over 127.0.0.1, with
+# perfshim.so dropping CLOSE_LOSS of every datagram sent.  Exits
+# non-zero unless each run delivers its input intact and both of its
+# processes exit 0: when the last ack is lost, the side that closed
+# first must still answer the other's retransmission rather than leave
+# it an ICMP error.
+#
+# Environment:
+#   CLOSE_RUNS     transfers (default 8)
+#   CLOSE_BYTES    bytes per transfer (default 20000)
+#   CLOSE_LOSS     fraction of datagrams perfshim.so drops (default 0.3)
+#   CLOSE_TIMEOUT  seconds before a run is declared hung (default 60)
+#   CLOSE_PORT     first UDP port to use (default 7800)
+
+set -eu
+
+runs=${CLOSE_RUNS:-8}
+bytes=${CLOSE_BYTES:-20000}
+loss=${CLOSE_LOSS:-0.3}
+timeout=${CLOSE_TIMEOUT:-60}
+port=${CLOSE_PORT:-7800}
+
+for f in ./reliable ./perfshim.so; do
+    if [ ! -x $f ] && [ ! -f $f ]; then
+	echo "$0: $f missing; run make check" >&2
+	exit 1
+    fi
+done
+
+work=$(mktemp -d)
+trap 'st=$?; rm -rf $work; exit $st' EXIT
+head -c $bytes /dev/urandom > $work/in
+
+# reliable dir args...: one end of a run, with loss, as a run's status
+reliable () {
+    local dir=$1
+    shift
+    timeout $timeout env PERFSHIM_DIR=$dir PERFSHIM_LOSS=$loss \
+	LD_PRELOAD=./perfshim.so ./reliable -w 8 -t 200 "$@"
+}
+
+# run i: one transfer; writes the failure, if any, to $work/i/failed
+run () {
+    local d=$work/$1 pa=$((port + 2 * $1)) pb=$((port + 2 * $1 + 1))
+    local rst=0 sst=0
+
+    mkdir $d
+    reliable $d $pb 127.0.0.1:$pa < /dev/null > $d/out 2> $d/recv.err &
+    local rpid=$!
+    sleep 0.2
+    reliable $d $pa 127.0.0.1:$pb < $work/in > /dev/null 2> $d/send.err \
+	|| sst=$?
+    wait $rpid || rst=$?
+
+    if [ $sst != 0 ] || [ $rst != 0 ]; then
+	echo "run $1: sender exited $sst, receiver $rst" > $d/failed
+	cat $d/send.err $d/recv.err >> $d/failed
+    elif ! cmp -s $work/in $d/out; then
+	echo "run $1: output differs from input" > $d/failed
+    fi
+}
+
+for i in $(seq 1 $runs); do
+    run $i &
+done
+wait
+
+status=0
+for i in $(seq 1 $runs); do
+    if [ -f $work/$i/failed ]; then
+	cat $work/$i/failed >&2
+	status=1
+    fi
+done
+[ $status = 0 ] && echo "$runs lossy transfers closed cleanly"
+exit $status
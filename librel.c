@@ -0,0 +1,359 @@
+/* conn_t layer for librel.a (see librel.h).
+ *
+ * Like sim.c, this replaces rlib.c under an unmodified reliable.c.
+ * The application's buffers stand in for the proxied TCP socket:
+ * conn_input copies straight out of the buffer given to librel_send
+ * while the window has room, and only what is left over is kept in
+ * sndbuf; conn_output hands data to the recv callback without
+ * buffering at all.  Protocol handlers are never re-entered: a
+ * librel_send or librel_pause made from a callback only sets flags
+ * that the outermost call acts on once reliable.c has returned. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+#include "librel.h"
+
+#define LIBREL_SNDBUF 65536
+#define LIBREL_RCVSPACE 65536	/* conn_bufspace while not paused */
+#define LIBREL_BATCH 256	/* datagrams per librel_process */
+
+struct conn {
+  rel_t *rel;
+  int fd;
+  uint32_t id;			/* for traces */
+  struct librel_callbacks cb;
+  void *arg;
+
+  const char *app;		/* caller's buffer during librel_send */
+  size_t applen;
+  char *sndbuf;			/* what the window had no room for */
+  size_t sndhead, sndlen;
+
+  int depth;			/* nested calls into reliable.c */
+  char want_read;		/* rel_read once depth drops to 0 */
+  char want_output;		/* rel_output likewise */
+  char refused;			/* librel_send fell short; call writable */
+  char shut;			/* librel_shutdown called */
+  char paused;
+  char dead;			/* rel_destroy has run */
+  char failed;			/* and the peer had not finished */
+  char heard;			/* a packet has arrived from the peer */
+};
+
+struct librel {
+  conn_t c;
+};
+
+const size_t conn_size = sizeof (struct librel);
+
+uint64_t
+conn_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The application owns the socket, so there are no kernel timestamps. */
+uint64_t
+conn_rxtime (conn_t *c)
+{
+  return conn_now ();
+}
+
+conn_t *
+conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+{
+  /* Every connection comes from librel_open. */
+  return NULL;
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  int n = send (c->fd, pkt, len, 0);
+  if (opt_debug)
+    print_pkt (pkt, "send", n);
+  if (trace_ring)
+    trace_record (c->id, TRACE_SEND, pkt, n);
+  return n;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  return c->paused ? 0 : LIBREL_RCVSPACE;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t n)
+{
+  if (c->paused && n)
+    return 0;
+  c->cb.recv (c->arg, n ? buf : NULL, n);
+  return n;
+}
+
+int
+conn_input (conn_t *c, void *_buf, size_t n)
+{
+  char *buf = _buf;
+  size_t k, done = 0;
+
+  if (c->sndlen) {
+    k = c->sndlen < n ? c->sndlen : n;
+    if (c->sndhead + k > LIBREL_SNDBUF)
+      k = LIBREL_SNDBUF - c->sndhead;
+    memcpy (buf, c->sndbuf + c->sndhead, k);
+    c->sndhead = (c->sndhead + k) % LIBREL_SNDBUF;
+    c->sndlen -= k;
+    done = k;
+  }
+  if (done < n && !c->sndlen && c->applen) {
+    k = c->applen < n - done ? c->applen : n - done;
+    memcpy (buf + done, c->app, k);
+    c->app += k;
+    c->applen -= k;
+    done += k;
+  }
+  if (done)
+    return done;
+  if (c->shut)
+    return -1;
+  return 0;
+}
+
+int
+conn_sendto (const struct sockaddr_storage *ss,
+	     const packet_t *pkt, size_t len)
+{
+  return -1;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  c->dead = 1;
+}
+
+void
+conn_trace (conn_t *c, int event, const packet_t *pkt, int n)
+{
+  if (trace_ring)
+    trace_record (c->id, event, pkt, n);
+}
+
+/* Runs deferred handlers once the outermost call is leaving reliable.c,
+ * then lets the application know it may send again. */
+static void
+librel_settle (conn_t *c)
+{
+  while (!c->dead && (c->want_read || c->want_output)) {
+    c->depth++;
+    if (c->want_output) {
+      c->want_output = 0;
+      rel_output (c->rel);
+    }
+    if (c->want_read && !c->dead) {
+      c->want_read = 0;
+      rel_read (c->rel);
+    }
+    c->depth--;
+  }
+  if (c->refused && c->sndlen < LIBREL_SNDBUF && !c->dead) {
+    c->refused = 0;
+    if (c->cb.writable)
+      c->cb.writable (c->arg);
+  }
+}
+
+struct librel *
+librel_open (int fd, const struct librel_config *conf,
+	     const struct librel_callbacks *cb, void *arg)
+{
+  static uint32_t nextid;
+  struct config_common cc;
+  struct librel *h;
+  conn_t *c;
+  int fl;
+
+  if (!cb || !cb->recv || (fl = fcntl (fd, F_GETFL)) < 0
+      || fcntl (fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!progname)
+    progname = "librel";
+
+  memset (&cc, 0, sizeof (cc));
+  cc.window = conf && conf->window > 0 ? conf->window : 1;
+  cc.timeout = conf && conf->timeout > 0 ? conf->timeout : 2000;
+  cc.timer = cc.timeout / 5;
+  cc.single_connection = 1;
+  if (conf) {
+    cc.fec = conf->fec;
+    cc.streams = conf->streams;
+    cc.timestamps = conf->timestamps;
+  }
+
+  c = conn_arena_alloc ();
+  h = (struct librel *) c;
+  if (!(c->sndbuf = malloc (LIBREL_SNDBUF))) {
+    conn_arena_free (c);
+    return NULL;
+  }
+  c->fd = fd;
+  c->id = ++nextid;
+  c->cb = *cb;
+  c->arg = arg;
+  if (!(c->rel = rel_create (c, NULL, &cc))) {
+    free (c->sndbuf);
+    conn_arena_free (c);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return h;
+}
+
+size_t
+librel_send (struct librel *h, const void *buf, size_t n)
+{
+  conn_t *c = &h->c;
+  size_t k, done;
+
+  if (c->dead || c->shut)
+    return 0;
+  if (!c->depth && !c->sndlen) {
+    /* Let rel_read take what fits in the window straight from buf. */
+    c->app = buf;
+    c->applen = n;
+    c->depth++;
+    rel_read (c->rel);
+    c->depth--;
+    done = n - c->applen;
+    c->applen = 0;
+  }
+  else
+    done = 0;
+
+  while (done < n && c->sndlen < LIBREL_SNDBUF) {
+    size_t tail = (c->sndhead + c->sndlen) % LIBREL_SNDBUF;
+    k = tail < c->sndhead ? c->sndhead - tail : LIBREL_SNDBUF - tail;
+    if (k > n - done)
+      k = n - done;
+    memcpy (c->sndbuf + tail, (const char *) buf + done, k);
+    c->sndlen += k;
+    done += k;
+  }
+  if (done < n)
+    c->refused = 1;
+  c->want_read = 1;
+  if (!c->depth)
+    librel_settle (c);
+  return done;
+}
+
+void
+librel_shutdown (struct librel *h)
+{
+  conn_t *c = &h->c;
+
+  c->shut = 1;
+  c->want_read = 1;
+  if (!c->depth)
+    librel_settle (c);
+}
+
+void
+librel_pause (struct librel *h, int paused)
+{
+  conn_t *c = &h->c;
+
+  c->paused = paused != 0;
+  if (!paused)
+    c->want_output = 1;
+  if (!c->depth)
+    librel_settle (c);
+}
+
+int
+librel_fd (const struct librel *h)
+{
+  return h->c.fd;
+}
+
+int
+librel_timeout (void)
+{
+  uint64_t deadline = rel_deadline (), now;
+
+  if (!deadline)
+    return -1;
+  now = conn_now ();
+  if (deadline <= now)
+    return 0;
+  /* Round up, so the caller does not wake just before the deadline. */
+  return (deadline - now + 999999) / 1000000;
+}
+
+int
+librel_process (struct librel *h)
+{
+  conn_t *c = &h->c;
+  uint64_t deadline;
+  packet_t *pkt;
+  int i, n;
+
+  if (c->dead) {
+    errno = c->failed ? ECONNREFUSED : 0;
+    return -1;
+  }
+  c->depth++;
+  for (i = 0; i < LIBREL_BATCH && !c->dead; i++) {
+    if ((n = recv (c->fd, pkt = rel_rxbuf (), sizeof (*pkt), 0)) < 0) {
+      /* ICMP port unreachable.  Until the peer has been heard from it
+       * may simply not have started yet, so keep retransmitting. */
+      if (errno == ECONNREFUSED && c->heard) {
+	c->failed = !rel_closing (c->rel);
+	rel_destroy (c->rel);
+      }
+      break;
+    }
+    c->heard = 1;
+    if (opt_debug)
+      print_pkt (pkt, "recv", n);
+    if (trace_ring)
+      trace_record (c->id, TRACE_RECV, pkt, n);
+    rel_recvpkt (c->rel, pkt, n);
+  }
+  if ((deadline = rel_deadline ()) && deadline <= conn_now ())
+    rel_timer ();
+  c->depth--;
+  librel_settle (c);
+  if (c->dead) {
+    errno = c->failed ? ECONNREFUSED : 0;
+    return -1;
+  }
+  return 0;
+}
+
+void
+librel_close (struct librel *h)
+{
+  conn_t *c = &h->c;
+
+  if (!c->dead)
+    rel_destroy (c->rel);
+  close (c->fd);
+  free (c->sndbuf);
+  conn_arena_free (c);
+}
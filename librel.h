@@ -0,0 +1,75 @@
+/* librel: the reliable transport as a library.
+ *
+ * Instead of proxying a TCP connection (reliable -c / -s), an
+ * application links librel.a and exchanges data with the protocol
+ * directly.  It supplies a UDP socket connected to the peer, which may
+ * be a stand-alone reliable process or another librel user, and drives
+ * the connection from its own event loop:
+ *
+ *	poll librel_fd (h) for POLLIN, with librel_timeout () as timeout;
+ *	then call librel_process (h).
+ *
+ * Data goes out with librel_send and comes back through the recv
+ * callback.  Callbacks run from inside librel_process, librel_send and
+ * librel_pause; they may call librel_send, librel_shutdown and
+ * librel_pause, but not librel_close.
+ *
+ * This header does not need rlib.h. */
+
+#ifndef _LIBREL_H_
+#define _LIBREL_H_ 1
+
+#include <stddef.h>
+
+struct librel;
+
+struct librel_config {
+  int window;			/* packets in flight, 0 for 1 */
+  int timeout;			/* retransmission timeout in ms, 0 for 2000 */
+  int fec;			/* data packets per FEC group, 0 for none */
+  int streams;			/* framed multi-stream mode (reliable -m) */
+  int timestamps;		/* offer the timestamp option (--timestamps) */
+};
+
+struct librel_callbacks {
+  /* In-order data from the peer, which must all be consumed.  n is 0
+   * once the peer has finished sending. */
+  void (*recv) (void *arg, const void *buf, size_t n);
+  /* librel_send, having refused data, can take more.  May be NULL. */
+  void (*writable) (void *arg);
+};
+
+/* Takes ownership of fd, a UDP socket connected to the peer, and makes
+ * it non-blocking.  conf may be NULL for the defaults.  Returns NULL
+ * with errno set on failure. */
+struct librel *librel_open (int fd, const struct librel_config *conf,
+			    const struct librel_callbacks *cb, void *arg);
+
+/* Queues up to n bytes and returns how many were taken; fewer than n
+ * means the send buffer is full and writable will be called. */
+size_t librel_send (struct librel *, const void *buf, size_t n);
+
+/* No more librel_send: the peer's recv sees n == 0 after the rest. */
+void librel_shutdown (struct librel *);
+
+/* While paused, recv is not called and the peer is flow-controlled. */
+void librel_pause (struct librel *, int paused);
+
+int librel_fd (const struct librel *);
+
+/* Milliseconds until librel_process has timer work for any open
+ * connection, or -1 if none.  Suitable as a poll timeout. */
+int librel_timeout (void);
+
+/* Reads what has arrived on the socket and runs any timers that are
+ * due.  Returns 0, or -1 once the connection is over: closed cleanly
+ * after librel_shutdown and the peer's end of data (errno 0), or failed
+ * because the peer's port became unreachable first (ECONNREFUSED).
+ * The handle must then be closed.  A clean close lingers up to three
+ * timeouts first, to acknowledge the peer's end of data again should
+ * its acknowledgment be lost. */
+int librel_process (struct librel *);
+
+void librel_close (struct librel *);
+
+#endif /* !_LIBREL_H_ */
@@ -0,0 +1,442 @@
+/* Microbenchmarks for the protocol hot paths.
+ *
+ * rlib.c is compiled into this file with send, read and write
+ * redirected to in-memory stubs, so the real conn_t layer and
+ * reliable.c run unmodified but no system calls are timed.  Including
+ * the source also gives the harness direct access to conn_t internals
+ * for building output queues.  Results are printed as JSON on stdout
+ * so runs can be diffed across commits. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <assert.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+
+static ssize_t bench_send (int s, const void *buf, size_t len, int flags);
+static ssize_t bench_read (int fd, void *buf, size_t len);
+static ssize_t bench_write (int fd, const void *buf, size_t len);
+
+#define send bench_send
+#define read bench_read
+#define write bench_write
+#define main rlib_main
+#include "rlib.c"
+#undef send
+#undef read
+#undef write
+#undef main
+
+#define PAYLOAD 500
+#define BATCH 4096
+#define REPEATS 5
+#define MIN_RUN_NS 20000000ULL
+
+static int write_blocked;	/* make bench_write return EAGAIN */
+static uint64_t sink;		/* keeps results live */
+
+static ssize_t
+bench_send (int s, const void *buf, size_t len, int flags)
+{
+  return len;
+}
+
+static ssize_t
+bench_read (int fd, void *buf, size_t len)
+{
+  memset (buf, 'x', len);
+  return len;
+}
+
+static ssize_t
+bench_write (int fd, const void *buf, size_t len)
+{
+  if (write_blocked) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return len;
+}
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static rel_t *
+bench_rel (int window)
+{
+  struct config_common cc;
+  conn_t *c;
+
+  memset (&cc, 0, sizeof (cc));
+  cc.window = window;
+  cc.timeout = 2000;
+  cc.timer = cc.timeout / 5;
+
+  c = conn_alloc ();
+  c->rfd = c->wfd = c->nfd = -1;
+  conn_mkevents ();
+  c->rel = rel_create (c, NULL, &cc);
+  return c->rel;
+}
+
+static void
+bench_rel_free (rel_t *r)
+{
+  conn_t *c;
+
+  for (c = conn_list; c && c->rel != r; c = c->next)
+    ;
+  rel_destroy (r);
+  conn_free (c);
+  conn_mkevents ();
+}
+
+static void
+make_pkt (packet_t *pkt, int len, uint32_t seqno, uint32_t ackno)
+{
+  memset (pkt, 0, sizeof (*pkt));
+  pkt->len = htons (len);
+  pkt->ackno = htonl (ackno);
+  if (len >= 12) {
+    pkt->seqno = htonl (seqno);
+    memset (pkt->data, 'd', len - 12);
+  }
+  pkt->cksum = cksum (pkt, len);
+}
+
+/* Delivers a copy in rel_rxbuf, as conn_poll's recv would, since
+ * rel_recvpkt rewrites the header in place. */
+static void
+deliver (rel_t *r, const packet_t *pkt)
+{
+  packet_t *buf = rel_rxbuf ();
+  size_t len = ntohs (pkt->len);
+  memcpy (buf, pkt, len);
+  rel_recvpkt (r, buf, len);
+}
+
+/* Each benchmark runs iters operations and returns the time spent in
+ * the measured part only. */
+typedef uint64_t (*bench_fn) (long param, uint64_t iters);
+
+static uint64_t
+bench_cksum (long size, uint64_t iters)
+{
+  char buf[sizeof (packet_t)];
+  uint64_t i, t0;
+  uint16_t acc = 0;
+
+  for (i = 0; i < sizeof (buf); i++)
+    buf[i] = i * 7;
+  t0 = now_ns ();
+  for (i = 0; i < iters; i++) {
+    buf[0] = i;
+    acc ^= cksum (buf, size);
+  }
+  sink += acc;
+  return now_ns () - t0;
+}
+
+static packet_t *stream;	/* seqnos 1..BATCH, built once */
+
+static void
+build_stream (void)
+{
+  int i;
+  if (stream)
+    return;
+  stream = xmalloc (BATCH * sizeof (*stream));
+  for (i = 0; i < BATCH; i++)
+    make_pkt (&stream[i], 12 + PAYLOAD, i + 1, 1);
+}
+
+static uint64_t
+bench_recv_inorder (long window, uint64_t iters)
+{
+  uint64_t done = 0, ns = 0, t0;
+  build_stream ();
+  while (done < iters) {
+    rel_t *r = bench_rel (window);
+    int i, n = iters - done < BATCH ? iters - done : BATCH;
+    t0 = now_ns ();
+    for (i = 0; i < n; i++)
+      deliver (r, &stream[i]);
+    ns += now_ns () - t0;
+    done += n;
+    bench_rel_free (r);
+  }
+  return ns;
+}
+
+/* Each run of window packets arrives last-first, so all but one are
+ * buffered and then released together. */
+static uint64_t
+bench_recv_reorder (long window, uint64_t iters)
+{
+  uint64_t done = 0, ns = 0, t0;
+  build_stream ();
+  while (done < iters) {
+    rel_t *r = bench_rel (window);
+    int base, i, n = BATCH - BATCH % window;
+    t0 = now_ns ();
+    for (base = 0; base < n; base += window)
+      for (i = window - 1; i >= 0; i--)
+	deliver (r, &stream[base + i]);
+    ns += now_ns () - t0;
+    done += n;
+    bench_rel_free (r);
+  }
+  return ns * iters / done;
+}
+
+static uint64_t
+bench_recv_dup (long window, uint64_t iters)
+{
+  rel_t *r = bench_rel (window);
+  uint64_t i, t0, ns;
+
+  build_stream ();
+  deliver (r, &stream[0]);
+  t0 = now_ns ();
+  for (i = 0; i < iters; i++)
+    deliver (r, &stream[0]);
+  ns = now_ns () - t0;
+  bench_rel_free (r);
+  return ns;
+}
+
+/* One ack per data packet; each frees a slot and lets rel_read send
+ * the next packet. */
+static uint64_t
+bench_ack_each (long window, uint64_t iters)
+{
+  packet_t *acks = xmalloc (BATCH * sizeof (*acks));
+  uint64_t done = 0, ns = 0, t0;
+  int i;
+
+  for (i = 0; i < BATCH; i++)
+    make_pkt (&acks[i], 8, 0, i + 2);
+  while (done < iters) {
+    rel_t *r = bench_rel (window);
+    int n = iters - done < BATCH ? iters - done : BATCH;
+    rel_read (r);
+    t0 = now_ns ();
+    for (i = 0; i < n; i++)
+      deliver (r, &acks[i]);
+    ns += now_ns () - t0;
+    done += n;
+    bench_rel_free (r);
+  }
+  free (acks);
+  return ns;
+}
+
+/* A single ack covering the whole window; cost is per acked packet
+ * and includes refilling the window. */
+static uint64_t
+bench_ack_window (long window, uint64_t iters)
+{
+  packet_t ack;
+  uint64_t done = 0, ns = 0, t0;
+
+  while (done < iters) {
+    rel_t *r = bench_rel (window);
+    int round;
+    rel_read (r);
+    t0 = now_ns ();
+    for (round = 1; round <= BATCH / window; round++) {
+      make_pkt (&ack, 8, 0, round * window + 1);
+      deliver (r, &ack);
+    }
+    ns += now_ns () - t0;
+    done += BATCH - BATCH % window;
+    bench_rel_free (r);
+  }
+  return ns * iters / done;
+}
+
+/* Stop-and-wait messaging: each op is a data packet from the peer that
+ * acks ours, is delivered and acked, and lets rel_read send the next
+ * message.  Window 2 runs the same exchange through the window
+ * arrays. */
+static uint64_t
+bench_stop_and_wait (long window, uint64_t iters)
+{
+  packet_t *msgs = xmalloc (BATCH * sizeof (*msgs));
+  uint64_t done = 0, ns = 0, t0;
+  int i;
+
+  for (i = 0; i < BATCH; i++)
+    make_pkt (&msgs[i], 12 + PAYLOAD, i + 1, i + 2);
+  while (done < iters) {
+    rel_t *r = bench_rel (window);
+    int n = iters - done < BATCH ? iters - done : BATCH;
+    rel_read (r);
+    t0 = now_ns ();
+    for (i = 0; i < n; i++)
+      deliver (r, &msgs[i]);
+    ns += now_ns () - t0;
+    done += n;
+    bench_rel_free (r);
+  }
+  free (msgs);
+  return ns;
+}
+
+static void
+outq_free (conn_t *c)
+{
+  chunk_t *ch, *nch;
+  for (ch = c->outq; ch; ch = nch) {
+    nch = ch->next;
+    free (ch);
+  }
+  c->outq = NULL;
+  c->outqtail = &c->outq;
+}
+
+/* rel_output releasing ready packets that were held back while the
+ * output queue was full. */
+static uint64_t
+bench_output (long ready, uint64_t iters)
+{
+  static char fill[8192];
+  uint64_t done = 0, ns = 0, t0;
+
+  build_stream ();
+  while (done < iters) {
+    rel_t *r = bench_rel (ready);
+    conn_t *c = conn_list;
+    int i;
+
+    write_blocked = 1;
+    conn_output (c, fill, sizeof (fill));
+    for (i = 0; i < ready; i++)
+      deliver (r, &stream[i]);
+    outq_free (c);
+    write_blocked = 0;
+
+    t0 = now_ns ();
+    rel_output (r);
+    ns += now_ns () - t0;
+    done += ready;
+    bench_rel_free (r);
+  }
+  return ns * iters / done;
+}
+
+static uint64_t
+bench_bufspace (long chunks, uint64_t iters)
+{
+  rel_t *r = bench_rel (1);
+  conn_t *c = conn_list;
+  uint64_t i, t0, ns;
+  size_t acc = 0;
+
+  for (i = 0; i < chunks; i++) {
+    chunk_t *ch = xmalloc (sizeof (*ch));
+    ch->next = NULL;
+    ch->size = 1;
+    ch->used = 0;
+    *c->outqtail = ch;
+    c->outqtail = &ch->next;
+  }
+  t0 = now_ns ();
+  for (i = 0; i < iters; i++)
+    acc += conn_bufspace (c);
+  ns = now_ns () - t0;
+  sink += acc;
+  outq_free (c);
+  bench_rel_free (r);
+  return ns;
+}
+
+struct bench {
+  const char *name;
+  bench_fn fn;
+  const char *unit;		/* what param means */
+  long params[6];		/* zero-terminated */
+  long bytes;			/* bytes per op for throughput, or 0 */
+};
+
+static const struct bench benches[] = {
+  { "cksum", bench_cksum, "bytes", { 8, 12, 64, 256, 512 }, -1 },
+  { "rel_recvpkt_inorder", bench_recv_inorder, "window", { 1, 32, 256 },
+    PAYLOAD },
+  { "rel_recvpkt_reorder", bench_recv_reorder, "window", { 8, 32, 256 },
+    PAYLOAD },
+  { "rel_recvpkt_dup", bench_recv_dup, "window", { 1, 32 }, 0 },
+  { "ack_each", bench_ack_each, "window", { 1, 8, 64, 512 }, 0 },
+  { "ack_window", bench_ack_window, "window", { 8, 64, 512 }, 0 },
+  { "stop_and_wait", bench_stop_and_wait, "window", { 1, 2 }, PAYLOAD },
+  { "rel_output", bench_output, "ready", { 1, 16, 256 }, PAYLOAD },
+  { "conn_bufspace", bench_bufspace, "chunks", { 1, 64, 1024, 8192 }, 0 },
+};
+
+/* Grows the iteration count until one run takes MIN_RUN_NS, then
+ * keeps the best of REPEATS runs. */
+static void
+run_bench (const struct bench *b, long param, int first)
+{
+  uint64_t iters = 1, ns, best = 0;
+  double ns_op;
+  int i;
+
+  while ((ns = b->fn (param, iters)) < MIN_RUN_NS && iters < (1ULL << 40))
+    iters *= ns < MIN_RUN_NS / 16 ? 8 : 2;
+  best = ns;
+  for (i = 1; i < REPEATS; i++)
+    if ((ns = b->fn (param, iters)) < best)
+      best = ns;
+  ns_op = (double) best / iters;
+
+  printf ("%s    {\"name\": \"%s\", \"%s\": %ld, \"iterations\": %llu, "
+	  "\"ns_per_op\": %.2f",
+	  first ? "" : ",\n", b->name, b->unit, param,
+	  (unsigned long long) iters, ns_op);
+  if (b->bytes)
+    printf (", \"mb_per_s\": %.1f",
+	    (b->bytes < 0 ? param : b->bytes) * 1e3 / ns_op);
+  printf ("}");
+  fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *filter = argc > 1 ? argv[1] : NULL;
+  size_t i;
+  int j, first = 1;
+
+  progname = "microbench";
+  if (argc > 2) {
+    fprintf (stderr, "usage: %s [name-prefix]\n", progname);
+    exit (1);
+  }
+
+  printf ("{\n  \"benchmarks\": [\n");
+  for (i = 0; i < sizeof (benches) / sizeof (benches[0]); i++) {
+    if (filter && strncmp (benches[i].name, filter, strlen (filter)))
+      continue;
+    for (j = 0; benches[i].params[j]; j++, first = 0)
+      run_bench (&benches[i], benches[i].params[j], first);
+  }
+  printf ("\n  ]\n}\n");
+  return sink == 42 ? 2 : 0;
+}
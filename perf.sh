@@ -0,0 +1,198 @@
+#!/bin/bash
+#
+# End-to-end throughput regression test.  Pipes a fixed stream through
+# two stand-alone reliable processes over 127.0.0.1 at several window
+# sizes and reports MB/s, CPU seconds, I/O syscalls per MB and peak RSS
+# for the pair, as perfshim.so records them when each process exits.
+# Exits non-zero if any window is more than PERF_THRESHOLD percent
+# slower than perf.baseline, or if any window fails to give a
+# measurement.
+#
+# Throughput depends on the machine, so perf.baseline is not kept in
+# the repository: run perf.sh -u (make perf-baseline) on a machine,
+# from a build known to be good, before the gate means anything there.
+# The baseline records the host it was taken on, and a baseline from
+# another host is refused.
+#
+# usage: perf.sh [-u]      (-u rewrites perf.baseline with this run)
+#
+# Environment:
+#   PERF_BYTES      bytes per run (default 2 GiB)
+#   PERF_WINDOWS    window sizes to run (default "1 8 64")
+#   PERF_LOSS       fraction of datagrams perfshim.so drops (default 0)
+#   PERF_RTO        -t passed to reliable, in ms (default 2000)
+#   PERF_THRESHOLD  allowed slowdown in percent (default 20)
+#   PERF_TIMEOUT    seconds before a run is declared hung (default 600)
+#   PERF_PORT       first UDP port to use (default 7700)
+
+set -eu
+
+bytes=${PERF_BYTES:-2147483648}
+windows=${PERF_WINDOWS:-"1 8 64"}
+loss=${PERF_LOSS:-0}
+rto=${PERF_RTO:-2000}
+threshold=${PERF_THRESHOLD:-20}
+timeout=${PERF_TIMEOUT:-600}
+port=${PERF_PORT:-7700}
+baseline=perf.baseline
+update=0
+spid=
+rpid=
+reader=
+host="$(uname -n) $(awk -F': ' '/^model name/ { print $2; exit }' /proc/cpuinfo)"
+
+if [ "${1-}" = "-u" ]; then
+    update=1
+elif [ $# -ne 0 ]; then
+    echo "usage: $0 [-u]" >&2
+    exit 1
+fi
+
+for f in ./reliable ./perfshim.so; do
+    if [ ! -x $f ] && [ ! -f $f ]; then
+	echo "$0: $f missing; run make perf" >&2
+	exit 1
+    fi
+done
+
+work=$(mktemp -d)
+trap 'st=$?; kill $spid $rpid $reader 2>/dev/null || :; rm -rf $work; exit $st' EXIT
+
+# shim pid counter: one of perfshim.c's counters for pid, empty if the
+# file is missing
+shim () {
+    local i
+    case $2 in
+	calls) i=0 ;; utime) i=3 ;; stime) i=4 ;; maxrss) i=5 ;; exited) i=6 ;;
+    esac
+    od -An -t u8 -j $((i * 8)) -N 8 $work/$1.calls 2>/dev/null | tr -d ' '
+}
+
+# wait_exit pid: waits up to $timeout seconds for a reliable process to
+# exit, as it does on its own once the connection has closed
+wait_exit () {
+    local waited=0
+    while kill -0 $1 2>/dev/null; do
+	if [ $waited -ge $((timeout * 10)) ]; then
+	    echo "window $w: reliable did not exit after the transfer" >&2
+	    return 1
+	fi
+	sleep 0.1
+	waited=$((waited + 1))
+    done
+    if ! wait $1; then
+	echo "window $w: reliable exited with an error" >&2
+	return 1
+    fi
+}
+
+baseline_for () {
+    [ -f $baseline ] || return 0
+    awk -v w=$1 '$1 == w { print $2 }' $baseline
+}
+
+if [ $update = 0 ]; then
+    if [ ! -f $baseline ]; then
+	echo "$0: no $baseline; run make perf-baseline on this machine" >&2
+	exit 1
+    fi
+    if [ "$(sed -n 's/^# host=//p' $baseline)" != "$host" ]; then
+	echo "$0: $baseline is from another machine;" \
+	     "run make perf-baseline here" >&2
+	exit 1
+    fi
+fi
+
+status=0
+results=
+printf "%-8s %10s %8s %12s %12s %10s\n" \
+    window MB/s cpu-s syscalls/MB peak-RSS-KB baseline
+
+for w in $windows; do
+    pa=$port
+    pb=$((port + 1))
+    port=$((port + 2))
+    rm -f $work/*
+    mkfifo $work/out
+
+    { head -c $bytes | wc -c > $work/count; } < $work/out &
+    reader=$!
+
+    PERFSHIM_DIR=$work PERFSHIM_LOSS=$loss LD_PRELOAD=./perfshim.so \
+	./reliable -w $w -t $rto $pb 127.0.0.1:$pa \
+	< /dev/null > $work/out 2> $work/recv.err &
+    rpid=$!
+    sleep 0.2
+
+    start=$(date +%s%N)
+    head -c $bytes /dev/zero | \
+	PERFSHIM_DIR=$work PERFSHIM_LOSS=$loss LD_PRELOAD=./perfshim.so \
+	./reliable -w $w -t $rto $pa 127.0.0.1:$pb \
+	> /dev/null 2> $work/send.err &
+    spid=$!
+
+    waited=0
+    while kill -0 $reader 2>/dev/null; do
+	if [ $waited -ge $((timeout * 10)) ]; then
+	    break
+	fi
+	sleep 0.1
+	waited=$((waited + 1))
+    done
+    end=$(date +%s%N)
+
+    if kill -0 $reader 2>/dev/null || [ "$(cat $work/count)" != $bytes ]; then
+	echo "window $w: transfer did not finish in ${timeout}s" >&2
+	kill $reader $spid $rpid 2>/dev/null || :
+	status=1
+	continue
+    fi
+
+    # CPU time and peak RSS come from the shim as each process exits
+    if ! wait_exit $spid || ! wait_exit $rpid; then
+	kill $spid $rpid 2>/dev/null || :
+	status=1
+	continue
+    fi
+    if [ "$(shim $spid exited)" != 1 ] || [ "$(shim $rpid exited)" != 1 ]
+    then
+	echo "window $w: no CPU or memory figures from perfshim.so" >&2
+	status=1
+	continue
+    fi
+    us=$(( $(shim $spid utime) + $(shim $spid stime)
+	   + $(shim $rpid utime) + $(shim $rpid stime) ))
+    rss=$(( $(shim $spid maxrss) + $(shim $rpid maxrss) ))
+    calls=$(( $(shim $spid calls) + $(shim $rpid calls) ))
+
+    mbs=$(awk -v b=$bytes -v ns=$((end - start)) \
+	'BEGIN { printf "%.1f", b / 1e6 / (ns / 1e9) }')
+    cpu=$(awk -v us=$us 'BEGIN { printf "%.2f", us / 1e6 }')
+    permb=$(awk -v c=$calls -v b=$bytes 'BEGIN { printf "%.0f", c / (b / 1e6) }')
+    base=$(baseline_for $w)
+
+    printf "%-8s %10s %8s %12s %12s %10s\n" \
+	$w $mbs $cpu $permb $rss "${base:--}"
+    results="$results$w $mbs
+"
+
+    if [ -n "$base" ] && [ $update = 0 ] \
+	&& awk -v m=$mbs -v b=$base -v t=$threshold \
+	    'BEGIN { exit !(m < b * (1 - t / 100)) }'; then
+	echo "window $w: $mbs MB/s is more than $threshold% below" \
+	     "baseline $base MB/s" >&2
+	status=1
+    fi
+done
+
+if [ $update = 1 ] && [ $status = 0 ]; then
+    {
+	echo "# window MB/s, written by perf.sh -u"
+	echo "# host=$host"
+	echo "# bytes=$bytes loss=$loss rto=$rto"
+	printf "%s" "$results"
+    } > $baseline
+    echo "wrote $baseline"
+fi
+
+exit $status
@@ -0,0 +1,186 @@
+/* LD_PRELOAD shim used by perf.sh.
+ *
+ * Counts the I/O system calls a reliable process makes and, when
+ * PERFSHIM_LOSS is set, silently drops that fraction of outgoing
+ * datagrams, which gives loss without needing tc netem.  Counters live
+ * in a file mapped MAP_SHARED ($PERFSHIM_DIR/<pid>.calls) so they can
+ * be read after the process is gone; on exit the process's CPU time
+ * and peak RSS are added, with EXITED set to show they are there. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+enum {
+  CALLS, SENDS, DROPS,
+  UTIME_US, STIME_US, MAXRSS_KB, EXITED,	/* set by perfshim_fini */
+  NCOUNTERS
+};
+
+static uint64_t scratch[NCOUNTERS];
+static uint64_t *counters = scratch;
+static double loss;
+static uint64_t rng_state = 1;
+
+static ssize_t (*real_send) (int, const void *, size_t, int);
+static ssize_t (*real_sendto) (int, const void *, size_t, int,
+			       const struct sockaddr *, socklen_t);
+static ssize_t (*real_recv) (int, void *, size_t, int);
+static ssize_t (*real_recvfrom) (int, void *, size_t, int,
+				 struct sockaddr *, socklen_t *);
+static ssize_t (*real_sendmsg) (int, const struct msghdr *, int);
+static ssize_t (*real_recvmsg) (int, struct msghdr *, int);
+static ssize_t (*real_read) (int, void *, size_t);
+static ssize_t (*real_write) (int, const void *, size_t);
+static int (*real_poll) (struct pollfd *, nfds_t, int);
+
+static void __attribute__ ((constructor))
+perfshim_init (void)
+{
+  const char *dir = getenv ("PERFSHIM_DIR");
+  const char *s;
+
+  real_send = dlsym (RTLD_NEXT, "send");
+  real_sendto = dlsym (RTLD_NEXT, "sendto");
+  real_recv = dlsym (RTLD_NEXT, "recv");
+  real_recvfrom = dlsym (RTLD_NEXT, "recvfrom");
+  real_sendmsg = dlsym (RTLD_NEXT, "sendmsg");
+  real_recvmsg = dlsym (RTLD_NEXT, "recvmsg");
+  real_read = dlsym (RTLD_NEXT, "read");
+  real_write = dlsym (RTLD_NEXT, "write");
+  real_poll = dlsym (RTLD_NEXT, "poll");
+
+  if ((s = getenv ("PERFSHIM_LOSS")))
+    loss = atof (s);
+  if ((s = getenv ("PERFSHIM_SEED")))
+    rng_state = strtoull (s, NULL, 0) | 1;
+  rng_state ^= (uint64_t) getpid () << 32;
+
+  if (dir) {
+    char name[4096];
+    int fd;
+    void *p;
+
+    snprintf (name, sizeof (name), "%s/%d.calls", dir, (int) getpid ());
+    fd = open (name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && ftruncate (fd, sizeof (scratch)) == 0
+	&& (p = mmap (NULL, sizeof (scratch), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0)) != MAP_FAILED)
+      counters = p;
+    if (fd >= 0)
+      close (fd);
+  }
+}
+
+static void __attribute__ ((destructor))
+perfshim_fini (void)
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) < 0)
+    return;
+  counters[UTIME_US] = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+  counters[STIME_US] = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+  counters[MAXRSS_KB] = ru.ru_maxrss;
+  counters[EXITED] = 1;
+}
+
+static int
+drop (void)
+{
+  counters[SENDS]++;
+  if (loss <= 0)
+    return 0;
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  if (((rng_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0)
+      >= loss)
+    return 0;
+  counters[DROPS]++;
+  return 1;
+}
+
+ssize_t
+send (int s, const void *buf, size_t len, int flags)
+{
+  counters[CALLS]++;
+  if (drop ())
+    return len;
+  return real_send (s, buf, len, flags);
+}
+
+ssize_t
+sendto (int s, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen)
+{
+  counters[CALLS]++;
+  if (drop ())
+    return len;
+  return real_sendto (s, buf, len, flags, to, tolen);
+}
+
+ssize_t
+sendmsg (int s, const struct msghdr *msg, int flags)
+{
+  size_t i, len = 0;
+
+  counters[CALLS]++;
+  for (i = 0; i < msg->msg_iovlen; i++)
+    len += msg->msg_iov[i].iov_len;
+  if (drop ())
+    return len;
+  return real_sendmsg (s, msg, flags);
+}
+
+ssize_t
+recv (int s, void *buf, size_t len, int flags)
+{
+  counters[CALLS]++;
+  return real_recv (s, buf, len, flags);
+}
+
+ssize_t
+recvfrom (int s, void *buf, size_t len, int flags,
+	  struct sockaddr *from, socklen_t *fromlen)
+{
+  counters[CALLS]++;
+  return real_recvfrom (s, buf, len, flags, from, fromlen);
+}
+
+ssize_t
+recvmsg (int s, struct msghdr *msg, int flags)
+{
+  counters[CALLS]++;
+  return real_recvmsg (s, msg, flags);
+}
+
+ssize_t
+read (int fd, void *buf, size_t len)
+{
+  counters[CALLS]++;
+  return real_read (fd, buf, len);
+}
+
+ssize_t
+write (int fd, const void *buf, size_t len)
+{
+  counters[CALLS]++;
+  return real_write (fd, buf, len);
+}
+
+int
+poll (struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  counters[CALLS]++;
+  return real_poll (fds, nfds, timeout);
+}
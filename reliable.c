@@ -9,38 +9,154 @@
 #include <time.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "rlib.h"
 
-#define MAX_DATA_SIZE 499
+#define MAX_DATA_SIZE 500
 #define ACK_PACKET_HEADER 8
 #define DATA_PACKET_HEADER 12
+#define MAX_WINDOW (1 << 17)
+#define WINDOW_PAGE 256		//slots per page of a window, power of 2
+#define TLP_MIN 10000000ULL	//floor on the tail loss probe timeout, ns
+#define STREAM_HEADER 4		//stream id and stream seqno, in multi-stream mode
+#define TS_OPTION 8		//tsval and tsecr, when TS_FLAG is set
+#define TS_OFFERS 3		//flagged acks sent to offer the option
+#define TS_OFFERED 1		//values of rel_t.timestamps
+#define TS_ON 2
+#define FEC_MIN_GROUP 4		//smallest group the loss adaptation will pick
+#define FEC_PENDING 8		//parity packets held while their group fills in
+#define FEC_HISTORY 256		//delivered packets kept for decoding
+#define FEC_REPORT_GROUPS 8	//parity groups seen between loss reports
+#define CACHE_LINE 64
+#define ARENA_SLAB (2 << 20)	//connection arena grows by this much
+#define PACKET_POOL 256		//spare packet buffers kept for reuse
+#define FIN_RETRIES 8		//resends of our EOF after the peer's before giving up
+#define TIME_WAIT_RTOS 3	//retransmission timeouts a closed connection lingers
+#define TIME_WAIT_BUCKETS 1024	//power of 2
+#define PEER_BUCKETS 4096	//power of 2
 
 struct Sender {
-	int last_frame_sent;
-	int buffer_position;
-	packet_t packet;
+	int last_frame_sent;	//highest seqno handed to the network
+	int buffer_position;	//oldest seqno not yet acknowledged
 };
 
 struct Receiver {
-	int last_frame_received;
+	int last_frame_received;	//first seqno missing from the window
 	int ackno;
-	int buffer_position;
-	int max_ack;
-	packet_t packet;
+	int buffer_position;	//next seqno to hand to conn_output
+	int max_ack;		//highest ackno sent so far
+	int highest_seen;	//one past the highest seqno buffered
+};
+
+/*
+ * Multi-stream mode: input arrives as records of a 2-byte stream id, a
+ * 2-byte length and that many bytes, which are cut into packets of one
+ * stream each.
+ */
+struct StreamInput {
+	uint8_t header[STREAM_HEADER];	//record header being read
+	int headerBytes;
+	int stream;	//stream of the current record
+	int remaining;	//bytes of the current record still to read
+	int discard;	//1 if the record names a stream we do not have
+};
+
+/*
+ * Multi-stream receiver: a stream's buffered packets that are not yet
+ * output, linked through WindowBuffer.streamLink in stream seqno order.
+ */
+struct StreamQueue {
+	int head, tail;	//seqnos of the first and last, 0 if none
+	int readyNext;	//next stream on rel_t.streamReady, -1 at the end
+	int ready;	//1 while on it
 };
 
 struct WindowBuffer {
 	packet_t* ptr;
-	int isFull;		//0 is for empty, 1 is for full
-	int timeStamp;
-	int acknowledged; //0 for no, 1 for yes
-	int outputted; //0 for no, 1 for yes
+	uint64_t timeStamp;	//conn_now() when last transmitted, or conn_rxtime() on arrival
+	int rtxNext;	//sender: retransmission queue links, seqnos or 0
+	int rtxPrev;
+	uint8_t isFull;		//0 is for empty, 1 is for full
+	uint8_t acknowledged; //0 for no, 1 for yes
+	uint8_t outputted; //0 for no, 1 for yes
+	uint8_t retransmitted; //1 once resent, so acks give no RTT sample (Karn)
+	int streamLink;	//receiver, multi-stream: next on its StreamQueue, or 0
+};
+
+/*
+ * Window arrays are cut into pages, allocated as packets land in them
+ * and, once a window spans more than one page, freed again when they
+ * empty; a large window only costs memory for what is in flight or
+ * buffered.
+ */
+struct WindowPage {
+	int full;	//slots in use
+	struct WindowBuffer slots[];
+};
+
+/*
+ * FEC sender state.  P is the XOR of a group's payloads and Q their
+ * sum weighted by g^i over GF(2^8), i being the packet's index in the
+ * group; together they rebuild any two losses.
+ */
+struct FecEncoder {
+	int groupSize;	//configured packets per group, 0 when FEC is off
+	int first;	//seqno of the first packet in the open group
+	int count;	//packets coded into the open group
+	int size;	//packets the open group will cover
+	int parities;	//1 sends P only, 2 sends P and Q
+	int maxlen;	//longest payload in the open group
+	int reportedLoss;	//peer's loss estimate in 1/65536 units
+	uint16_t plen, qlen;	//coded payload lengths
+	uint8_t p[MAX_DATA_SIZE];
+	uint8_t q[MAX_DATA_SIZE];
 };
 
-/* reliable_state type is the main data structure that holds all the crucial information for this lab */
+struct FecParity {
+	int isFull;
+	int first;	//seqno of the group's first packet
+	int count;	//packets in the group
+	int index;	//0 for P, 1 for Q
+	int len;	//bytes of parity
+	uint16_t codedLen;
+	uint8_t data[MAX_DATA_SIZE];
+};
+
+struct FecDecoder {
+	int lastGroup;	//first seqno of the newest group sampled for loss
+	int groupsSinceReport;
+	int loss;	//EWMA of the fraction missing per group, 1/65536 units
+	struct FecParity pending[FEC_PENDING];
+	packet_t *history[FEC_HISTORY];	//delivered packets, by seqno
+};
+
+/*
+ * Token bucket limiting a connection's send rate.  Every data, parity
+ * and retransmitted packet spends its length in tokens; only new data
+ * waits for them, so the debt from retransmissions is paid back by
+ * holding off later input.
+ */
+struct TokenBucket {
+	double rate;	//bytes per nanosecond, 0 for no limit
+	double burst;	//bucket size in bytes
+	double tokens;	//may go negative after retransmissions
+	uint64_t refilled;	//conn_now() tokens were last added
+	uint64_t wakeup;	//when enough tokens for a full packet will be in
+	uint64_t throttledSince;	//0 unless new data is waiting on tokens
+};
+
+/*
+ * reliable_state type is the main data structure that holds all the
+ * crucial information for this lab.  It lives in the connection arena
+ * right behind its conn_t.  Everything the per-packet paths touch comes
+ * first, starting on a cache line; window slots are allocated on first
+ * use and only as many as the window needs, and FEC decoding state only
+ * once a parity packet arrives.
+ */
 struct reliable_state {
 	rel_t *next; /* Linked list for traversing all connections */
 	rel_t **prev;
@@ -50,317 +166,2234 @@ struct reliable_state {
 	struct Sender sender;
 	struct Receiver receiver;
 	int windowSize;
-	struct WindowBuffer senderWindowBuffer[1000];
-	struct WindowBuffer receiverWindowBuffer[1000];
+	int windowMask;	//window arrays hold windowMask + 1 slots
+	int pageShift;	//and pages 1 << pageShift of them
+	struct WindowPage **senderWindow;	//page directory, NULL until the first send
+	struct WindowPage **receiverWindow;	//page directory, NULL until the first data
+	int rtxHead;	//in-flight seqnos, least recently transmitted first
+	int rtxTail;
+	uint64_t timeout;	//retransmission timeout in nanoseconds
+	uint64_t deadline;	//when rel_timer next has work here, while timerIndex is set
+	int timerIndex;	//position in timerHeap, 0 if no timer is armed
+	rel_t *timerNext;	//rel_timer's list of connections due
+	int stopAndWait;	//window of 1 without FEC or streams: see saw_send_pkt
+	int sawRetransmitted;	//stop-and-wait: sendPacket has been resent
+	uint64_t sawSentAt;	//stop-and-wait: conn_now() sendPacket last went out
+	uint64_t lastActive;	//conn_now() when data last went out or came in
+	struct rel_stats stats;
+	int tlpSeqno;	//packet resent as a tail loss probe since the last new ack, or 0
+	int frtoState;	//after a timeout until an ack covers frtoSeqno: 2 if holding back,
+			//3 if frtoSeqno is a hole found by a partial ack
+	int frtoSeqno;	//the packet resent
+	int frtoRecover;	//last packet sent before the timeout
+	uint64_t frtoSentAt;	//when the resend went out
+	int timestamps;	//0 unless --timestamps, then TS_OFFERED until the peer stamps too
+	int tsOffers;	//flagged acks sent while TS_OFFERED
+	uint32_t tsRecent;	//tsval to echo: the last in-order data packet's
+	uint32_t tsEcho;	//tsecr of the packet being processed, 0 if none
+
+	// Colder: per packet only with FEC, rate limits or streams
+	struct TokenBucket bucket;
+	struct FecDecoder *fecDecoder;	//NULL until the first parity packet
+	uint64_t idle;	//quiet time before buffers are given back, 0 never
+	int finSeqno;	//seqno of our EOF packet, 0 until input ends
+	int finRetries;	//times our EOF was resent after the peer's was output
+	int peerFinished;	//1 once the peer's EOF has been output
+	uint64_t lingerUntil;	//closed, but re-acking the peer's EOF until then; else 0
+	int streams;	//0 for a single unframed stream
+	uint16_t *streamSent;	//next stream seqno to send, per stream
+	uint16_t *streamNext;	//next stream seqno to deliver, per stream
+	struct StreamQueue *streamQueue;	//per stream
+	int streamReady, streamReadyTail;	//streams whose head is next, -1 if none
+	struct StreamInput streamInput;
+	struct sockaddr_storage peer;	//client address, when created by rel_demux
+	rel_t *peerNext;	//peerHash chain, for connections with a peer
+	rel_t **peerPrev;
+	struct FecEncoder fecEncoder;
+	struct hist *latency;	//LAT_NUM histograms, NULL until the first sample
+	uint64_t inputBlocked;	//conn_now() rel_read last left input unread, or 0
+	packet_t sendPacket;	//data packet being filled from conn_input
+} __attribute__((aligned(CACHE_LINE)));
+/*
+ * What is left of a server connection after a clean close: enough to
+ * ack the peer's EOF again if our ack of it was lost.  Records are
+ * hashed by peer address and expire in the order they were made.
+ */
+struct TimeWait {
+	struct sockaddr_in6 peer;	//large enough for AF_INET too
+	int ackno;
+	uint64_t expires;
+	struct TimeWait *next;	//hash chain
+	struct TimeWait **prev;
+	struct TimeWait *nextExpiry;
 };
-rel_t *rel_list; //rel_t is a type of reliable state
-int timestamp = 0;
-
-void initialize(rel_t *r, int windowSize) {
-
-	r->sender.packet.cksum = 0;
-	r->sender.packet.len = 0;
-	r->sender.packet.ackno = 1;
-	r->sender.packet.seqno = 0;
-	r->sender.last_frame_sent = -1;   //makes sense because you want to start at 0
-	r->sender.buffer_position = 0;
-	r->receiver.packet.cksum = 0;
-	r->receiver.packet.len = 0;
-	r->receiver.packet.ackno = 1;
-	r->receiver.packet.seqno = 0;		//should this seqno be = 1?
-	r->receiver.last_frame_received = 0;
-	r->receiver.ackno = 0;
-	r->receiver.max_ack = 0;
-	r->receiver.buffer_position = 0;
-	r->windowSize = windowSize;
-	memset(&r->senderWindowBuffer, 0, sizeof(&r->senderWindowBuffer));
-	memset(&r->receiverWindowBuffer, 0, sizeof(&r->receiverWindowBuffer));
-}
 
-/* Creates a new reliable protocol session, returns NULL on failure.
- * Exactly one of c and ss should be NULL.  (ss is NULL when called
- * from rlib.c, while c is NULL when this function is called from
- * rel_demux.) */
-rel_t *
-rel_create(conn_t *c, const struct sockaddr_storage *ss,
-		const struct config_common *cc) {
-	rel_t *r;
+static rel_t *rel_list; //rel_t is a type of reliable state
+static rel_t *peerHash[PEER_BUCKETS];	//rel_demux's connections by peer address
+static rel_t **timerHeap;	//connections with a timer armed, a min-heap on deadline from [1]
+static int timerCount, timerSize;
+static struct TimeWait *timeWaitHash[TIME_WAIT_BUCKETS];
+static struct TimeWait *timeWaitHead, **timeWaitTail = &timeWaitHead;
+static int timeWaitCount;
+static int lingerCount;	//connections other than records in TIME_WAIT
 
-	r = xmalloc(sizeof(*r));
-	memset(r, 0, sizeof(*r));
+static void preparePacketForSending(packet_t *pkt);
+static void receive_data(rel_t *r, packet_t *pkt);
+static void output_data(rel_t *r);
+static int close_if_done(rel_t *r);
+static void saw_process_ack(rel_t *s, int ackno);
+static void saw_send_pkt(rel_t *s, int data_size);
+static int saw_receive_data(rel_t *r, packet_t *pkt);
+static void stream_park(rel_t *r, int seqno);
 
-	if (!c) { //create a connection if there is no connection
-		c = conn_create(r, ss);
-		if (!c) {
-			free(r);
-			return NULL;
-		}
-	}
+/*
+ * Memory held for connections: arena blocks, window arrays, packet
+ * copies and FEC and stream state.  Past mem_budget a connection only
+ * takes another packet buffer to make progress, which shrinks every
+ * window to what the remaining memory can hold.
+ */
+static uint64_t mem_used, mem_peak;
+static uint64_t mem_budget;	//0 for no limit
+static packet_t *packet_pool[PACKET_POOL];
+static int packet_pooled;
+static packet_t *rxSpare;	//rel_rxbuf's buffer, until receive_data adopts it
+static struct hist latencyClosed[LAT_NUM];	//folded in by rel_destroy
 
-	r->c = c; //set up r's connection
-	r->next = rel_list;
-	r->prev = &rel_list;
-	if (rel_list)
-		rel_list->prev = &r->next;
-	rel_list = r;
+static void mem_charge(int64_t bytes) {
+	mem_used += bytes;
+	if (mem_used > mem_peak) {
+		mem_peak = mem_used;
+	}
+}
 
-	/* Do any other initialization you need here */
+static int mem_allows_packet(void) {
+	return !mem_budget || mem_used + sizeof(packet_t) <= mem_budget;
+}
 
-	initialize(r, cc->window);
-	return r;
+static packet_t *packet_alloc(void) {
+	mem_charge(sizeof(packet_t));
+	if (packet_pooled) {
+		return packet_pool[--packet_pooled];
+	}
+	return xmalloc(sizeof(packet_t));
 }
 
-void rel_destroy(rel_t *r) {
-	if (r->next)
-		r->next->prev = r->prev;
-	*r->prev = r->next;
-	conn_destroy(r->c); //destroy the connection
+static void packet_free(packet_t *p) {
+	if (!p) {
+		return;
+	}
+	mem_charge(-(int64_t) sizeof(packet_t));
+	if (packet_pooled < PACKET_POOL) {
+		packet_pool[packet_pooled++] = p;
+	} else {
+		free(p);
+	}
+}
 
-	/* Free any other allocated memory here */
+/*
+ * Method to hand rlib a buffer to receive into.  receive_data keeps it
+ * as the window slot's packet instead of copying, and a new one comes
+ * from the pool next time; if the packet is rejected the same buffer
+ * is reused.
+ */
+packet_t *rel_rxbuf(void) {
+	if (!rxSpare) {
+		rxSpare = packet_alloc();
+	}
+	return rxSpare;
 }
 
-/* This function only gets called when the process is running as a
- * server and must handle connections from multiple clients.  You have
- * to look up the rel_t structure based on the address in the
- * sockaddr_storage passed in.  If this is a new connection (sequence
- * number 1), you will need to allocate a new conn_t using rel_create
- * ().  (Pass rel_create NULL for the conn_t, so it will know to
- * allocate a new connection.)
+/*
+ * Methods for a receive path that owns its buffers (io_uring's ring):
+ * rel_rxgive makes pkt the spare before it is passed in, and rel_rxtake
+ * takes the spare back afterwards, which is pkt again unless the window
+ * kept it.  Only the spare counts as connection memory.
  */
-void rel_demux(const struct config_common *cc,
-		const struct sockaddr_storage *ss, packet_t *pkt, size_t len) {
+void rel_rxgive(packet_t *pkt) {
+	packet_free(rxSpare);
+	mem_charge(sizeof(packet_t));
+	rxSpare = pkt;
 }
 
-void preparePacketForSending(packet_t *pkt) {
-	int packetLength = pkt->len;
-	pkt->ackno = htons(pkt->ackno);
-	pkt->len = htons(pkt->len);
-	if (packetLength >= DATA_PACKET_HEADER) {
-		pkt->seqno = htons(pkt->seqno);
-	}
+packet_t *rel_rxtake(void) {
+	packet_t *p = rel_rxbuf();
+	rxSpare = NULL;
+	mem_charge(-(int64_t) sizeof(packet_t));
+	return p;
 }
 
-void convertPacketFromNetworkByteOrder(packet_t *pkt) {
-	pkt->len = ntohs(pkt->len);
-	pkt->ackno = ntohs(pkt->ackno);
-	pkt->seqno = ntohs(pkt->seqno);
+void rel_memory(uint64_t *used, uint64_t *peak) {
+	*used = mem_used;
+	*peak = mem_peak;
 }
 
 /*
- * Method to resend ack packets when they were dropped.
+ * Method to record a latency sample, allocating the connection's
+ * histograms on its first.  Out of line, so the receive path it is
+ * called from stays small.
  */
-void retransmit_ack(rel_t *r, int ackVal) {
-	packet_t *ackPacket = malloc(sizeof (struct packet));
-	ackPacket->len = ACK_PACKET_HEADER;
-	ackPacket->ackno = ackVal;
-	int ackLength = ackPacket->len;
-	preparePacketForSending(ackPacket);
-	ackPacket->cksum = 0;
-	ackPacket->cksum = cksum(ackPacket, ackLength);
-	conn_sendpkt(r->c, ackPacket, ackPacket->len);
+static void __attribute__((noinline)) latency_record(rel_t *r, int kind, uint64_t ns) {
+	if (!r->latency) {
+		r->latency = xmalloc(LAT_NUM * sizeof(struct hist));
+		memset(r->latency, 0, LAT_NUM * sizeof(struct hist));
+		mem_charge(LAT_NUM * sizeof(struct hist));
+	}
+	hist_record(&r->latency[kind], ns);
+}
+
+// How long the data now going out was left unread (see input_blocked)
+static void latency_queued(rel_t *s, uint64_t now) {
+	latency_record(s, LAT_QUEUE, s->inputBlocked ? now - s->inputBlocked : 0);
+	s->inputBlocked = 0;
+}
+
+// Arrival to output; kernel and loop clocks may disagree by a hair
+static void latency_delivered(rel_t *r, uint64_t arrived, uint64_t now) {
+	latency_record(r, LAT_DELIVER, now > arrived ? now - arrived : 0);
+}
+
+const struct hist *rel_latency(rel_t *r) {
+	return r->latency;
+}
+
+void rel_latency_total(struct hist total[LAT_NUM]) {
+	rel_t *r;
+	int i;
+
+	memcpy(total, latencyClosed, sizeof(latencyClosed));
+	for (r = rel_list; r; r = r->next) {
+		for (i = 0; r->latency && i < LAT_NUM; i++) {
+			hist_add(&total[i], &r->latency[i]);
+		}
+	}
 }
 
 /*
- * Method to resend data packets when they were dropped.
- * This method is called in rel_timer().
+ * Timer heap.  Each connection with timer work is in it once, at the
+ * earliest deadline armed for it, so rel_timer only visits connections
+ * that are due, however many there are.
  */
-void retransmit_data(rel_t *s, int seqno) {
-	struct WindowBuffer *packet = &s->senderWindowBuffer[seqno];
-	conn_sendpkt(s->c, packet->ptr, packet->ptr->len);
+static void timer_place(rel_t *r, int i) {
+	timerHeap[i] = r;
+	r->timerIndex = i;
+}
+
+static void timer_up(rel_t *r, int i) {
+	while (i > 1 && timerHeap[i / 2]->deadline > r->deadline) {
+		timer_place(timerHeap[i / 2], i);
+		i /= 2;
+	}
+	timer_place(r, i);
+}
+
+static void timer_down(rel_t *r, int i) {
+	int child;
+	while ((child = 2 * i) <= timerCount) {
+		if (child < timerCount && timerHeap[child + 1]->deadline < timerHeap[child]->deadline) {
+			child++;
+		}
+		if (timerHeap[child]->deadline >= r->deadline) {
+			break;
+		}
+		timer_place(timerHeap[child], i);
+		i = child;
+	}
+	timer_place(r, i);
+}
+
+static void timer_remove(rel_t *r) {
+	int i = r->timerIndex;
+	rel_t *last;
+
+	if (!i) {
+		return;
+	}
+	r->timerIndex = 0;
+	last = timerHeap[timerCount--];
+	if (last != r) {
+		timer_up(last, i);
+		timer_down(last, last->timerIndex);
+	}
 }
 
 /*
- * Method used to compute the correct cumulative ack number.
- * Gets tricky when frames come out of order.
+ * Method to make sure rel_timer looks at r by when.  Deadlines only
+ * move earlier here; when it is due, rel_timer takes r off the heap
+ * and r arms whatever it still needs.
  */
-int compute_LFR(rel_t *r) {
-	//Iterate through a section of the buffer, looking for the first place a packet is missing
-	int i;
-	int shift = r->receiver.buffer_position;
-	for (i = shift; i <= r->windowSize + shift; i++) {
-		if (r->receiverWindowBuffer[i].isFull == 0) {
-			return i;
+static void arm_timer(rel_t *r, uint64_t when) {
+	if (r->timerIndex) {
+		if (when >= r->deadline) {
+			return;
+		}
+		r->deadline = when;
+		timer_up(r, r->timerIndex);
+		return;
+	}
+	if (timerCount + 1 >= timerSize) {
+		int size = timerSize ? 2 * timerSize : 64;
+		rel_t **heap = xmalloc(size * sizeof(*heap));
+		if (timerCount) {
+			memcpy(heap, timerHeap, (timerCount + 1) * sizeof(*heap));
 		}
+		free(timerHeap);
+		timerHeap = heap;
+		mem_charge((int64_t) (size - timerSize) * sizeof(*timerHeap));
+		timerSize = size;
 	}
-	return -1;
+	r->deadline = when;
+	timer_up(r, ++timerCount);
 }
 
-void send_data_pkt(rel_t *s, int data_size) {
+/*
+ * Connection arena.  Blocks hold a conn_t, padded to a cache line, and
+ * then its rel_t.  They are carved from ARENA_SLAB slabs that are never
+ * unmapped; freed blocks go on a free list for the next connection.
+ */
+int conn_arena_hugepages;
+static void *arena_free_list;
+static char *arena_next, *arena_end;
 
-	//update sender state when a new data packet is sent
-	s->sender.last_frame_sent++;
-	s->sender.packet.len = data_size + DATA_PACKET_HEADER;
-	s->sender.packet.seqno = s->sender.last_frame_sent;
-	s->sender.packet.ackno = s->sender.packet.seqno + 1; //ackno should always be 1 higher than seqno
+static size_t arena_conn_part(void) {
+	return (conn_size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+}
 
-	//fprintf(stderr, "seqno: %i, buffer position: %i\n", s->sender.packet.seqno, s->sender.buffer_position);
-	//alert the user when user has exceeded sender's window size
-	if (s->sender.packet.seqno > s->windowSize + s->sender.buffer_position || s->sender.packet.seqno == s->windowSize + s->sender.buffer_position) {
-//		fprintf(stderr, "**** You have exceeded the sender's window size. Packet will not be sent. **** \n");
-		s->sender.last_frame_sent--;
-		return;
+static void arena_grow(void) {
+	void *slab = MAP_FAILED;
+	if (conn_arena_hugepages) {
+		slab = mmap(NULL, ARENA_SLAB, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
 	}
+	if (slab == MAP_FAILED) {
+		slab = mmap(NULL, ARENA_SLAB, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			fprintf(stderr, "%s: out of memory\n", progname);
+			abort();
+		}
+		// No reserved huge pages: let THP back the slab instead
+		if (conn_arena_hugepages) {
+			madvise(slab, ARENA_SLAB, MADV_HUGEPAGE);
+		}
+	}
+	arena_next = slab;
+	arena_end = arena_next + ARENA_SLAB;
+}
 
-	int positionInArray = s->sender.packet.seqno;
-	int length = s->sender.packet.len;
-	preparePacketForSending(&(s->sender.packet));
-	s->sender.packet.cksum = 0;
-	s->sender.packet.cksum = cksum(&s->sender.packet, length);
+conn_t *conn_arena_alloc(void) {
+	size_t size = arena_conn_part() + sizeof(rel_t);
+	void *block;
 
-	//prepare a copy of the packet along with other state to store in sender buffer
-	packet_t *sendingPacketCopy = malloc(sizeof s->sender.packet);
-	memcpy(sendingPacketCopy, &s->sender.packet, sizeof s->sender.packet);
-	struct WindowBuffer *packetBuffer = malloc(sizeof(struct WindowBuffer));
-	packetBuffer->isFull = 1;
-	packetBuffer->ptr = sendingPacketCopy;
-	packetBuffer->timeStamp = timestamp;
+	if (arena_free_list) {
+		block = arena_free_list;
+		arena_free_list = *(void **) block;
+	} else {
+		if (arena_end - arena_next < (ptrdiff_t) size) {
+			arena_grow();
+		}
+		block = arena_next;
+		arena_next += size;
+	}
+	memset(block, 0, size);
+	mem_charge(size);
+	return block;
+}
 
-	//place the WindowBuffer in the buffer array
-	s->senderWindowBuffer[positionInArray] = *packetBuffer;
+void conn_arena_free(conn_t *c) {
+	mem_charge(-(int64_t) (arena_conn_part() + sizeof(rel_t)));
+	*(void **) c = arena_free_list;
+	arena_free_list = c;
+}
 
-	//send the packet over network
-	conn_sendpkt(s->c, &s->sender.packet, s->sender.packet.len);
-	memset(&s->sender.packet, 0, sizeof(&s->sender.packet));
+static rel_t *block_rel(conn_t *c) {
+	return (rel_t *) ((char *) c + arena_conn_part());
+}
 
+conn_t *rel_conn_block(rel_t *r) {
+	return (conn_t *) ((char *) r - arena_conn_part());
 }
 
-void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
+/*
+ * Window slots are reused modulo a power of two no smaller than the
+ * window, so a seqno only ever shares its slot with seqnos a full
+ * array apart.  sender_slot and receiver_slot are for seqnos known to
+ * be in the window; window_lookup returns NULL for a page not there.
+ */
+static int window_pages(rel_t *r) {
+	return (r->windowMask >> r->pageShift) + 1;
+}
 
-	// Compare checksums to detect packet corruption
-	int checksum = pkt->cksum;
-	pkt->cksum = 0;
-	int compare_checksum = cksum(pkt, ntohs(pkt->len));
-	convertPacketFromNetworkByteOrder(pkt);
-	if (compare_checksum != checksum) {
-		return;
+static size_t window_page_size(rel_t *r) {
+	return sizeof(struct WindowPage) + (sizeof(struct WindowBuffer) << r->pageShift);
+}
+
+static struct WindowBuffer *window_slot(rel_t *r, struct WindowPage **w, int seqno) {
+	int i = seqno & r->windowMask;
+	return &w[i >> r->pageShift]->slots[i & ((1 << r->pageShift) - 1)];
+}
+
+static struct WindowBuffer *sender_slot(rel_t *s, int seqno) {
+	return window_slot(s, s->senderWindow, seqno);
+}
+
+static struct WindowBuffer *receiver_slot(rel_t *r, int seqno) {
+	return window_slot(r, r->receiverWindow, seqno);
+}
+
+static struct WindowBuffer *window_lookup(rel_t *r, struct WindowPage **w, int seqno) {
+	int i = seqno & r->windowMask;
+	if (!w || !w[i >> r->pageShift]) {
+		return NULL;
 	}
+	return &w[i >> r->pageShift]->slots[i & ((1 << r->pageShift) - 1)];
+}
 
-	r->receiver.packet = *pkt;
+// Claims the empty slot for seqno, allocating its page as needed
+static struct WindowBuffer *window_fill(rel_t *r, struct WindowPage ***w, int seqno) {
+	struct WindowPage **page;
+	if (!*w) {
+		size_t size = window_pages(r) * sizeof(**w);
+		*w = xmalloc(size);
+		memset(*w, 0, size);
+		mem_charge(size);
+	}
+	page = &(*w)[(seqno & r->windowMask) >> r->pageShift];
+	if (!*page) {
+		*page = xmalloc(window_page_size(r));
+		memset(*page, 0, window_page_size(r));
+		mem_charge(window_page_size(r));
+	}
+	(*page)->full++;
+	return window_slot(r, *w, seqno);
+}
 
-	// CASE 1: ACK packet
-	if (pkt->len == ACK_PACKET_HEADER) {
-		int index = pkt->ackno;
-		r->senderWindowBuffer[index-1].acknowledged = 1;
+static void page_free(rel_t *r, struct WindowPage **page) {
+	int i;
+	for (i = 0; i < 1 << r->pageShift; i++) {
+		packet_free((*page)->slots[i].ptr);
+	}
+	mem_charge(-(int64_t) window_page_size(r));
+	free(*page);
+	*page = NULL;
+}
 
-		//make sure to acknowledge everything below the most recent ackno
-		int i;
-		for (i = 0; i < index; i++) {
-			r->senderWindowBuffer[i].acknowledged = 1;
+static void window_free(rel_t *r, struct WindowPage ***w) {
+	int i;
+	if (!*w) {
+		return;
+	}
+	for (i = 0; i < window_pages(r); i++) {
+		if ((*w)[i]) {
+			page_free(r, &(*w)[i]);
 		}
+	}
+	mem_charge(-(int64_t) (window_pages(r) * sizeof(**w)));
+	free(*w);
+	*w = NULL;
+}
 
-		//move the sender's buffer position pointer
-		if (pkt->ackno > r->sender.buffer_position) {
-			r->sender.buffer_position = pkt->ackno;
-		}
+static void fec_decoder_free(rel_t *r) {
+	int i;
+	if (!r->fecDecoder) {
+		return;
+	}
+	for (i = 0; i < FEC_HISTORY; i++) {
+		packet_free(r->fecDecoder->history[i]);
 	}
+	mem_charge(-(int64_t) sizeof(struct FecDecoder));
+	free(r->fecDecoder);
+	r->fecDecoder = NULL;
+}
 
-	// CASE 2: DATA packet
-	if (pkt->len >= DATA_PACKET_HEADER) {
+// Empties a full slot; a single-page window keeps its page
+static void window_clear(rel_t *r, struct WindowPage **w, int seqno) {
+	struct WindowPage **page = &w[(seqno & r->windowMask) >> r->pageShift];
+	struct WindowBuffer *slot = window_slot(r, w, seqno);
+	packet_free(slot->ptr);
+	memset(slot, 0, sizeof(*slot));
+	if (--(*page)->full == 0 && window_pages(r) > 1) {
+		page_free(r, page);
+	}
+}
 
-		// You are getting duplicate packets by nature of cumulative ack
-		if (r->receiverWindowBuffer[pkt->seqno].isFull == 1) {
-			/* If the seqno of packet is less than the max ack the receiver has sent
-			 * that means an ack to the sender was dropped. Retransmit.
-			 */
-			if (pkt->seqno < r->receiver.max_ack) {
-				retransmit_ack(r, r->receiver.max_ack);
-			}
-			return;
-		}
+/*
+ * The retransmission queue links in-flight packets in the order they
+ * were last sent, so the oldest is always at the head and rel_timer
+ * never looks past the first that has not timed out.
+ */
+static void rtx_append(rel_t *s, int seqno) {
+	struct WindowBuffer *slot = sender_slot(s, seqno);
+	slot->rtxNext = 0;
+	slot->rtxPrev = s->rtxTail;
+	if (s->rtxTail) {
+		sender_slot(s, s->rtxTail)->rtxNext = seqno;
+	} else {
+		s->rtxHead = seqno;
+	}
+	s->rtxTail = seqno;
+}
 
-		// Alerting the user when the receiver's window buffer is full.
-		if (pkt->seqno >= r->windowSize + r->receiver.buffer_position) {
-			return;
-		}
+static void rtx_remove(rel_t *s, int seqno) {
+	struct WindowBuffer *slot = sender_slot(s, seqno);
+	if (slot->rtxPrev) {
+		sender_slot(s, slot->rtxPrev)->rtxNext = slot->rtxNext;
+	} else {
+		s->rtxHead = slot->rtxNext;
+	}
+	if (slot->rtxNext) {
+		sender_slot(s, slot->rtxNext)->rtxPrev = slot->rtxPrev;
+	} else {
+		s->rtxTail = slot->rtxPrev;
+	}
+}
 
-		// Clear out the old data from the packet buffer
-		int j;
-		int start = pkt->len - DATA_PACKET_HEADER;
-		for (j = start; j < MAX_DATA_SIZE; j++) {
-			pkt->data[j] = '\0';
-		}
+/*
+ * Method to give back the buffers of a connection that has been quiet
+ * for r->idle with nothing in flight or waiting for output: window
+ * arrays, FEC decoding state and delivery history.  The next packet
+ * allocates them again.
+ */
+static int rel_busy(rel_t *r) {
+	return r->sender.last_frame_sent >= r->sender.buffer_position
+			|| r->receiver.highest_seen > r->receiver.buffer_position;
+}
 
-		// Prepare a copy of the packet for the receiver's buffer
-		packet_t *receivingPacketCopy = malloc(sizeof (struct packet));
-		memcpy(receivingPacketCopy, pkt, sizeof (struct packet));
-		struct WindowBuffer *packetBuffer = malloc(sizeof(struct WindowBuffer));
-		packetBuffer->isFull = 1;
-		packetBuffer->ptr = receivingPacketCopy;
-		packetBuffer->timeStamp = timestamp;
+static void rel_reclaim(rel_t *r) {
+	window_free(r, &r->senderWindow);
+	window_free(r, &r->receiverWindow);
+	fec_decoder_free(r);
+	r->stats.idle_reclaims++;
+}
 
-		r->receiverWindowBuffer[pkt->seqno] = *packetBuffer;
+/*
+ * GF(2^8) arithmetic for the Q parity, generator 2 over x^8+x^4+x^3+x^2+1.
+ * gf_exp is doubled so a product of two logs never needs a modulo.
+ */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
 
-		/* when you receive the correct seqno you have been expecting,
-		 * recompute what the new ack should be */
-		if (r->receiver.last_frame_received == pkt->seqno) {
-			r->receiver.last_frame_received = compute_LFR(r);
+static void gf_init(void) {
+	int i, x = 1;
+	if (gf_exp[0]) {
+		return;
+	}
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= 0x11d;
 		}
+	}
+}
 
-		rel_output(r);
+//a * g^logb
+static uint8_t gf_mul(uint8_t a, int logb) {
+	return a ? gf_exp[gf_log[a] + logb] : 0;
+}
 
-		if (r->receiver.last_frame_received > r->receiver.max_ack) {
-			r->receiver.max_ack = r->receiver.last_frame_received;
-		}
+static uint16_t gf_mul16(uint16_t a, int logb) {
+	return gf_mul(a & 0xff, logb) | gf_mul(a >> 8, logb) << 8;
+}
 
-		// method for transmit or retransmit ack is the same..
-		retransmit_ack(r, r->receiver.last_frame_received);
+/*
+ * Method to add the tokens earned since the last refill.
+ */
+static void bucket_refill(rel_t *s, uint64_t now) {
+	struct TokenBucket *b = &s->bucket;
+	b->tokens += (now - b->refilled) * b->rate;
+	if (b->tokens > b->burst) {
+		b->tokens = b->burst;
 	}
+	b->refilled = now;
 }
 
-void rel_read(rel_t *s) {
-	int data_size = 0;
-	data_size = conn_input(s->c, s->sender.packet.data, MAX_DATA_SIZE);
+static void bucket_spend(rel_t *s, int length) {
+	if (s->bucket.rate) {
+		s->bucket.tokens -= length;
+	}
+}
 
-	if (data_size == 0) {
-		return;
+/*
+ * Method to decide whether new data may go out now.  If not, rel_timer
+ * is armed for when the bucket holds a full packet and calls rel_read
+ * again then, so a throttled connection sleeps rather than spins.
+ */
+static int bucket_allows(rel_t *s) {
+	struct TokenBucket *b = &s->bucket;
+	uint64_t now;
+
+	if (!b->rate) {
+		return 1;
+	}
+	now = conn_now();
+	bucket_refill(s, now);
+	if (b->tokens >= DATA_PACKET_HEADER + MAX_DATA_SIZE) {
+		if (b->throttledSince) {
+			s->stats.throttle_ns += now - b->throttledSince;
+			b->throttledSince = 0;
+		}
+		return 1;
+	}
+	b->wakeup = now + (uint64_t) ((DATA_PACKET_HEADER + MAX_DATA_SIZE - b->tokens) / b->rate) + 1;
+	arm_timer(s, b->wakeup);
+	if (!b->throttledSince) {
+		b->throttledSince = now;
 	}
+	return 0;
+}
 
-	else if (data_size > 0 && data_size <= MAX_DATA_SIZE) {
-		send_data_pkt(s, data_size);
+/*
+ * Method to leave a TIME_WAIT record for a server connection that is
+ * closing cleanly, in place of the connection.  Returns 0 for other
+ * connections, which have a socket of their own and linger whole.
+ */
+static int time_wait_add(rel_t *r) {
+	struct TimeWait *tw;
+	unsigned int bucket;
+
+	if (!r->peer.ss_family || addrsize(&r->peer) > sizeof(tw->peer)) {
+		return 0;
 	}
+	tw = xmalloc(sizeof(*tw));
+	memset(tw, 0, sizeof(*tw));
+	mem_charge(sizeof(*tw));
+	memcpy(&tw->peer, &r->peer, addrsize(&r->peer));
+	tw->ackno = r->receiver.buffer_position;
+	tw->expires = conn_now() + TIME_WAIT_RTOS * r->timeout;
 
-	else if (data_size > MAX_DATA_SIZE) {
-		send_data_pkt(s, MAX_DATA_SIZE);
+	bucket = addrhash(&r->peer) & (TIME_WAIT_BUCKETS - 1);
+	tw->next = timeWaitHash[bucket];
+	tw->prev = &timeWaitHash[bucket];
+	if (tw->next) {
+		tw->next->prev = &tw->next;
 	}
+	timeWaitHash[bucket] = tw;
+	*timeWaitTail = tw;
+	timeWaitTail = &tw->nextExpiry;
+	timeWaitCount++;
+	return 1;
 }
 
-void rel_output(rel_t *r) {
+static struct TimeWait *time_wait_find(const struct sockaddr_storage *ss) {
+	struct TimeWait *tw = timeWaitHash[addrhash(ss) & (TIME_WAIT_BUCKETS - 1)];
+	while (tw && !addreq((const struct sockaddr_storage *) &tw->peer, ss)) {
+		tw = tw->next;
+	}
+	return tw;
+}
 
-	int i;
-	int shift = r->receiver.buffer_position;
-	for (i = shift; i < r->windowSize + shift; i++) {
-		if (r->receiverWindowBuffer[i].isFull == 0) {
-			return;
-		}
+// Ends tw's TIME_WAIT at once; the record itself is freed when it expires
+static void time_wait_unhash(struct TimeWait *tw) {
+	if (tw->next) {
+		tw->next->prev = tw->prev;
+	}
+	*tw->prev = tw->next;
+	tw->prev = NULL;
+	timeWaitCount--;
+}
 
-		if (r->receiverWindowBuffer[i].isFull == 1) {
-			if (r->receiverWindowBuffer[i].outputted == 0) {
-				int availableSpace = conn_bufspace(r->c);
-				struct WindowBuffer *packet = malloc(sizeof(struct WindowBuffer));
-				packet = &r->receiverWindowBuffer[i];
-				if (availableSpace >= packet->ptr->len) {
-					conn_output(r->c, packet->ptr->data, packet->ptr->len);
-					r->receiver.buffer_position++;
-					r->receiverWindowBuffer[i].outputted = 1;
-				}
-			}
+// Records expire in order, so only the head is ever due, and
+// rel_deadline looks no further
+static void time_wait_expire(uint64_t now) {
+	struct TimeWait *tw;
+	while ((tw = timeWaitHead) && tw->expires <= now) {
+		timeWaitHead = tw->nextExpiry;
+		if (!timeWaitHead) {
+			timeWaitTail = &timeWaitHead;
+		}
+		if (tw->prev) {
+			time_wait_unhash(tw);
 		}
+		mem_charge(-(int64_t) sizeof(*tw));
+		free(tw);
 	}
 }
 
-void rel_timer() {
-	/* Retransmit any packets that need to be retransmitted */
-	rel_t *r = rel_list;
-	timestamp++;
+int rel_lingering(void) {
+	return timeWaitCount + lingerCount;
+}
 
-	int i;
-	int shift = r->sender.buffer_position;
-	for (i = shift; i < r->windowSize + shift; i++) {
-		if (r->senderWindowBuffer[i].isFull == 1) {
-			if (r->senderWindowBuffer[i].acknowledged == 0) {
-				if ((timestamp - r->senderWindowBuffer[i].timeStamp) > 5) {
-					retransmit_data(r, i);
-				}
+/*
+ * Closed and lingering, or with both EOFs sent and the peer's output,
+ * waiting only for acks (TCP's LAST_ACK).  A peer that goes away now
+ * has closed, as rel_timer also decides after FIN_RETRIES.
+ */
+int rel_closing(rel_t *r) {
+	return r->lingerUntil || (r->peerFinished && r->finSeqno);
+}
+
+static void initialize(rel_t *r, const struct config_common *cc) {
+
+	r->sendPacket.cksum = 0;
+	r->sendPacket.len = 0;
+	r->sendPacket.ackno = 1;
+	r->sendPacket.seqno = 0;
+	r->sender.last_frame_sent = 0;   //the first seqno in a stream is 1
+	r->sender.buffer_position = 1;
+	r->receiver.last_frame_received = 1;
+	r->receiver.ackno = 1;
+	r->receiver.max_ack = 1;
+	r->receiver.buffer_position = 1;
+	r->receiver.highest_seen = 1;
+	r->windowSize = cc->window;
+	if (r->windowSize > MAX_WINDOW) {
+		r->windowSize = MAX_WINDOW;
+	}
+	r->windowMask = 1;
+	while (r->windowMask < r->windowSize) {
+		r->windowMask <<= 1;
+	}
+	r->windowMask--;
+	r->pageShift = 0;
+	while (1 << r->pageShift <= r->windowMask && 1 << r->pageShift < WINDOW_PAGE) {
+		r->pageShift++;
+	}
+	r->timeout = (uint64_t) cc->timeout * 1000000;
+	r->idle = (uint64_t) cc->idle * 1000000;
+	mem_budget = cc->mem_budget;
+	r->fecEncoder.groupSize = cc->fec;
+	if (cc->rate) {
+		r->bucket.rate = cc->rate / 1e9;
+		// At least one full packet, or nothing could ever be sent
+		r->bucket.burst = cc->burst > DATA_PACKET_HEADER + MAX_DATA_SIZE
+				? cc->burst : DATA_PACKET_HEADER + MAX_DATA_SIZE;
+		r->bucket.tokens = r->bucket.burst;
+		r->bucket.refilled = conn_now();
+	}
+	r->streams = cc->streams;
+	r->timestamps = cc->timestamps ? TS_OFFERED : 0;
+	r->stopAndWait = r->windowSize == 1 && !r->fecEncoder.groupSize && !r->streams;
+	if (r->streams) {
+		r->streamSent = xmalloc(r->streams * sizeof(uint16_t));
+		r->streamNext = xmalloc(r->streams * sizeof(uint16_t));
+		memset(r->streamSent, 0, r->streams * sizeof(uint16_t));
+		memset(r->streamNext, 0, r->streams * sizeof(uint16_t));
+		r->streamQueue = xmalloc(r->streams * sizeof(struct StreamQueue));
+		memset(r->streamQueue, 0, r->streams * sizeof(struct StreamQueue));
+		mem_charge(r->streams * (2 * sizeof(uint16_t) + sizeof(struct StreamQueue)));
+		r->streamReady = r->streamReadyTail = -1;
+	}
+	gf_init();
+}
+
+/* Creates a new reliable protocol session, returns NULL on failure.
+ * Exactly one of c and ss should be NULL.  (ss is NULL when called
+ * from rlib.c, while c is NULL when this function is called from
+ * rel_demux.) */
+rel_t *
+rel_create(conn_t *c, const struct sockaddr_storage *ss,
+		const struct config_common *cc) {
+	rel_t *r;
+
+	if (c) {
+		r = block_rel(c);
+	} else { //create a connection if there is no connection
+		r = block_rel(conn_arena_alloc());
+		c = conn_create(r, ss);
+		if (!c) {
+			conn_arena_free(rel_conn_block(r));
+			return NULL;
+		}
+	}
+
+	r->c = c; //set up r's connection
+	if (ss) {
+		rel_t **bucket = &peerHash[addrhash(ss) & (PEER_BUCKETS - 1)];
+		r->peer = *ss;
+		r->peerNext = *bucket;
+		r->peerPrev = bucket;
+		if (*bucket)
+			(*bucket)->peerPrev = &r->peerNext;
+		*bucket = r;
+	}
+	r->next = rel_list;
+	r->prev = &rel_list;
+	if (rel_list)
+		rel_list->prev = &r->next;
+	rel_list = r;
+
+	/* Do any other initialization you need here */
+
+	initialize(r, cc);
+	PROBE2(create, r, r->windowSize);
+	return r;
+}
+
+void rel_destroy(rel_t *r) {
+	PROBE1(destroy, r);
+	timer_remove(r);
+	if (r->lingerUntil) {
+		lingerCount--;
+	}
+	if (r->next)
+		r->next->prev = r->prev;
+	*r->prev = r->next;
+	if (r->peerPrev) {
+		if (r->peerNext)
+			r->peerNext->peerPrev = r->peerPrev;
+		*r->peerPrev = r->peerNext;
+	}
+	conn_destroy(r->c); //destroy the connection
+
+	/* Free any other allocated memory here.  r itself goes back to
+	 * the arena with its conn_t. */
+	window_free(r, &r->senderWindow);
+	window_free(r, &r->receiverWindow);
+	fec_decoder_free(r);
+	if (r->latency) {
+		int i;
+		for (i = 0; i < LAT_NUM; i++) {
+			hist_add(&latencyClosed[i], &r->latency[i]);
+		}
+		free(r->latency);
+		mem_charge(-(int64_t) (LAT_NUM * sizeof(struct hist)));
+	}
+	mem_charge(-(int64_t) (r->streams * (2 * sizeof(uint16_t) + sizeof(struct StreamQueue))));
+	free(r->streamSent);
+	free(r->streamNext);
+	free(r->streamQueue);
+}
+
+/* This function only gets called when the process is running as a
+ * server and must handle connections from multiple clients.  You have
+ * to look up the rel_t structure based on the address in the
+ * sockaddr_storage passed in.  If this is a new connection (sequence
+ * number 1), you will need to allocate a new conn_t using rel_create
+ * ().  (Pass rel_create NULL for the conn_t, so it will know to
+ * allocate a new connection.)
+ */
+void rel_demux(const struct config_common *cc,
+		const struct sockaddr_storage *ss, packet_t *pkt, size_t len) {
+	rel_t *r = peerHash[addrhash(ss) & (PEER_BUCKETS - 1)];
+
+	while (r && !addreq(&r->peer, ss)) {
+		r = r->peerNext;
+	}
+	if (r) {
+		rel_recvpkt(r, pkt, len);
+		return;
+	}
+
+	// Past here only intact data packets count: stray acks and damaged
+	// packets are for no connection we still have
+	if (len < DATA_PACKET_HEADER || (ntohs(pkt->len) & ~TS_FLAG) != len
+			|| len > sizeof(*pkt)) {
+		return;
+	}
+	uint16_t checksum = pkt->cksum;
+	pkt->cksum = 0;
+	int intact = cksum(pkt, len) == checksum;
+	pkt->cksum = checksum;
+	if (!intact) {
+		return;
+	}
+
+	// A closed connection's peer resending its EOF: our ack was lost.
+	// A first packet instead means the peer has started over.
+	struct TimeWait *tw = time_wait_find(ss);
+	if (tw && ntohl(pkt->seqno) != 1) {
+		packet_t ack;
+		ack.len = ACK_PACKET_HEADER;
+		ack.ackno = tw->ackno;
+		preparePacketForSending(&ack);
+		ack.cksum = 0;
+		ack.cksum = cksum(&ack, ACK_PACKET_HEADER);
+		conn_sendto(ss, &ack, ACK_PACKET_HEADER);
+		return;
+	}
+	if (tw) {
+		time_wait_unhash(tw);
+	}
+
+	// Only a first data packet opens a connection, so retransmissions
+	// for a closed one are dropped
+	if (ntohl(pkt->seqno) != 1 || !(r = rel_create(NULL, ss, cc))) {
+		return;
+	}
+	rel_recvpkt(r, pkt, len);
+}
+
+static void preparePacketForSending(packet_t *pkt) {
+	int packetLength = pkt->len;
+	pkt->ackno = htonl(pkt->ackno);
+	pkt->len = htons(pkt->len);
+	if (packetLength >= DATA_PACKET_HEADER) {
+		pkt->seqno = htonl(pkt->seqno);
+	}
+}
+
+static void convertPacketFromNetworkByteOrder(packet_t *pkt) {
+	pkt->len = ntohs(pkt->len);
+	pkt->ackno = ntohl(pkt->ackno);
+	pkt->seqno = ntohl(pkt->seqno);
+}
+
+/*
+ * Method to trace a packet that has already been converted to host
+ * byte order; traces keep header fields as they were on the wire.
+ */
+static void trace_event(rel_t *r, int event, const packet_t *pkt) {
+	if (trace_ring) {
+		packet_t header;
+		header.ackno = htonl(pkt->ackno);
+		header.seqno = htonl(pkt->seqno);
+		conn_trace(r->c, event, &header, pkt->len);
+	}
+}
+
+// Every packet goes out here, in network byte order
+static void send_pkt(rel_t *r, const packet_t *pkt, int length) {
+	PROBE3(send, r, pkt, length);
+	conn_sendpkt(r->c, pkt, length);
+}
+
+/*
+ * Timestamp option (see rlib.h).  The clock is conn_now() in
+ * microseconds, never 0, which an echo keeps to mean none.  The option
+ * is written in network order straight after length bytes of pkt.
+ */
+static uint32_t ts_clock(uint64_t now) {
+	uint32_t ts = now / 1000;
+	return ts ? ts : 1;
+}
+
+static uint64_t ts_elapsed(rel_t *s, uint32_t ts) {
+	return (uint64_t) (uint32_t) (ts_clock(conn_rxtime(s->c)) - ts) * 1000;
+}
+
+static int ts_append(rel_t *r, packet_t *pkt, int length, uint64_t now) {
+	uint32_t option[2] = { htonl(ts_clock(now)), htonl(r->tsRecent) };
+	memcpy((char *) pkt + length, option, TS_OPTION);
+	return length + TS_OPTION;
+}
+
+// New data leaves room for the option once it is on
+static int max_payload(rel_t *s) {
+	return s->timestamps == TS_ON ? MAX_DATA_SIZE - TS_OPTION : MAX_DATA_SIZE;
+}
+
+/*
+ * Method to bring the option on a stored packet up to date before it
+ * is sent again.  length includes the option.
+ */
+static void ts_restamp(rel_t *s, packet_t *pkt, int length, uint64_t now) {
+	ts_append(s, pkt, length - TS_OPTION, now);
+	pkt->cksum = 0;
+	pkt->cksum = cksum(pkt, length);
+}
+
+/*
+ * Method to take in the option of a packet already in host order.
+ * The peer evidently speaks it, so an offer becomes TS_ON.  Data sent
+ * before the last in-order packet is a stale duplicate (PAWS): it is
+ * dropped without an ack, and returns 0.
+ */
+static int ts_receive(rel_t *r, packet_t *pkt, uint32_t tsval, uint32_t tsecr) {
+	if (r->timestamps == TS_OFFERED) {
+		r->timestamps = TS_ON;
+	}
+	if (pkt->len >= DATA_PACKET_HEADER) {
+		if (pkt->seqno < r->receiver.buffer_position && r->tsRecent
+				&& (int32_t) (tsval - r->tsRecent) < 0) {
+			r->stats.paws_rejected++;
+			trace_event(r, TRACE_DUP, pkt);
+			return 0;
+		}
+		if (pkt->seqno <= r->receiver.buffer_position) {
+			r->tsRecent = tsval;
+		}
+	}
+	r->tsEcho = tsecr;
+	return 1;
+}
+
+static void send_ack(rel_t *r, int ackVal, int stamped) {
+	packet_t ackPacket;
+	int length = ACK_PACKET_HEADER;
+	if (stamped) {
+		length = ts_append(r, &ackPacket, length, conn_now());
+	}
+	ackPacket.len = htons(stamped ? length | TS_FLAG : length);
+	ackPacket.ackno = htonl(ackVal);
+	ackPacket.cksum = 0;
+	ackPacket.cksum = cksum(&ackPacket, length);
+	send_pkt(r, &ackPacket, length);
+}
+
+/*
+ * Method to offer the option alongside our first few packets.  Peers
+ * that do not know it drop the flagged ack as malformed.
+ */
+static void ts_offer(rel_t *r) {
+	if (r->tsOffers < TS_OFFERS) {
+		r->tsOffers++;
+		send_ack(r, r->receiver.buffer_position, 1);
+	}
+}
+
+/*
+ * Method to send an ack packet.  Acks are cumulative, so sending one
+ * again is also how dropped acks get resent.
+ */
+static void retransmit_ack(rel_t *r, int ackVal) {
+	r->stats.acks_sent++;
+	send_ack(r, ackVal, r->timestamps == TS_ON);
+	if (r->timestamps == TS_OFFERED) {
+		ts_offer(r);
+	}
+}
+
+/*
+ * Method to resend data packets when they were dropped.
+ * This method is called in rel_timer().
+ */
+static void retransmit_data(rel_t *s, int seqno) {
+	struct WindowBuffer *packet = sender_slot(s, seqno);
+	int length = ntohs(packet->ptr->len) & ~TS_FLAG;
+	packet->timeStamp = conn_now();
+	packet->retransmitted = 1;
+	if (ntohs(packet->ptr->len) & TS_FLAG) {
+		ts_restamp(s, packet->ptr, length, packet->timeStamp);
+	}
+	rtx_remove(s, seqno);
+	rtx_append(s, seqno);
+	s->stats.retransmits++;
+	bucket_spend(s, length);
+	conn_trace(s->c, TRACE_RETRANSMIT, packet->ptr, length);
+	PROBE3(retransmit, s, seqno, length);
+	send_pkt(s, packet->ptr, length);
+	if (seqno == s->finSeqno && s->peerFinished) {
+		s->finRetries++;
+	}
+}
+
+/*
+ * Tail loss probe: when the newest packet has gone unacked for about
+ * two round trips, resend it once, so a loss at the end of a burst is
+ * repaired by the ack it draws instead of waiting out the timeout.
+ */
+static uint64_t probe_timeout(rel_t *s) {
+	uint64_t pto = 2 * s->stats.srtt_ns;
+	return pto > TLP_MIN ? pto : TLP_MIN;
+}
+
+static int probe_allowed(rel_t *s) {
+	return !s->tlpSeqno && !s->frtoState && s->stats.rtt_samples
+			&& probe_timeout(s) < s->timeout;
+}
+
+/*
+ * Method to settle a timeout once an ack covers the packet resent for
+ * it (Eifel style).  The timeout was spurious if the ack echoes a
+ * timestamp from before the resend, or without timestamps if it came
+ * too quickly to be answering the resend; the held packets then get
+ * their timers back as if it had never fired.  Acks are cumulative, so
+ * one that stops short of what was in flight at the timeout names the
+ * next hole: that packet alone is resent at once, and the rest stay
+ * held, so each hole costs one retransmission and one round trip
+ * rather than the whole flight going again.  Only an echoed timestamp
+ * is proof enough to skip that: the quick-ack test is fooled by a
+ * minimum RTT that includes queueing, and at worst the repair resends
+ * one packet per ack.
+ */
+static void frto_ack(rel_t *s, int ackno) {
+	uint64_t now;
+	int held = s->frtoState >= 2;
+	int spurious = 0;
+	int seqno;
+
+	if (ackno <= s->frtoSeqno) {
+		return;
+	}
+	now = conn_now();
+	if (s->frtoState != 3) {
+		if (s->tsEcho) {
+			spurious = (int32_t) (s->tsEcho - ts_clock(s->frtoSentAt)) < 0;
+		} else {
+			spurious = conn_rxtime(s->c) - s->frtoSentAt < s->stats.rtt_min_ns / 2;
+		}
+	}
+	s->frtoState = 0;
+	if (spurious) {
+		s->stats.spurious_timeouts++;
+		for (seqno = s->rtxHead; held && seqno; seqno = sender_slot(s, seqno)->rtxNext) {
+			struct WindowBuffer *packet = sender_slot(s, seqno);
+			if (packet->timeStamp >= s->frtoSentAt) {
+				break;
+			}
+			packet->timeStamp = s->frtoSentAt;
+		}
+	}
+	if (held && ackno <= s->frtoRecover && !(spurious && s->tsEcho)) {
+		s->frtoState = 3;
+		s->frtoSeqno = ackno;
+		s->frtoSentAt = now;
+		retransmit_data(s, ackno);
+		arm_timer(s, now + s->timeout);
+		return;
+	}
+	if (s->rtxHead) {
+		arm_timer(s, sender_slot(s, s->rtxHead)->timeStamp + s->timeout);
+	}
+}
+
+/*
+ * Method to run a connection's timers from rel_timer.  A timeout
+ * resends only the oldest unacked packet and holds the rest of the
+ * flight until acks show which others are missing (frto_ack), or
+ * until that resend times out in turn.
+ */
+static void retransmit_timer(rel_t *r, uint64_t now) {
+	if (!r->rtxHead) {
+		return;
+	}
+	if (r->frtoState >= 2 && now - r->frtoSentAt < r->timeout) {
+		arm_timer(r, r->frtoSentAt + r->timeout);
+		return;
+	}
+	if (r->frtoState >= 2 || now - sender_slot(r, r->rtxHead)->timeStamp >= r->timeout) {
+		r->stats.timeouts++;
+		r->frtoState = 2;
+		r->frtoSeqno = r->sender.buffer_position;
+		r->frtoRecover = r->sender.last_frame_sent;
+		r->frtoSentAt = now;
+		retransmit_data(r, r->frtoSeqno);
+		arm_timer(r, now + r->timeout);
+		return;
+	}
+	arm_timer(r, sender_slot(r, r->rtxHead)->timeStamp + r->timeout);
+
+	if (probe_allowed(r)) {
+		struct WindowBuffer *tail = sender_slot(r, r->sender.last_frame_sent);
+		if (now - tail->timeStamp >= probe_timeout(r)) {
+			r->stats.tlp_probes++;
+			r->tlpSeqno = r->sender.last_frame_sent;
+			retransmit_data(r, r->tlpSeqno);
+		} else {
+			arm_timer(r, tail->timeStamp + probe_timeout(r));
+		}
+	}
+}
+
+/*
+ * Method used to compute the correct cumulative ack number.
+ * Gets tricky when frames come out of order.
+ */
+static int compute_LFR(rel_t *r) {
+	//Walk forward from the current hole until the next missing packet
+	int i = r->receiver.last_frame_received;
+	int end = r->receiver.buffer_position + r->windowSize;
+	struct WindowBuffer *slot;
+	while (i < end && (slot = window_lookup(r, r->receiverWindow, i)) && slot->isFull == 1) {
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Method used to fold an RTT sample into the statistics.
+ */
+static void update_rtt(rel_t *s, uint64_t sample) {
+	if (s->stats.rtt_samples++ == 0) {
+		s->stats.srtt_ns = sample;
+		s->stats.rtt_min_ns = sample;
+	} else {
+		s->stats.srtt_ns += ((int64_t) sample - (int64_t) s->stats.srtt_ns) / 8;
+	}
+	if (sample < s->stats.rtt_min_ns) {
+		s->stats.rtt_min_ns = sample;
+	}
+	if (sample > s->stats.rtt_max_ns) {
+		s->stats.rtt_max_ns = sample;
+	}
+	latency_record(s, LAT_RTT, sample);
+	PROBE4(rtt, s, sample, s->stats.srtt_ns, s->stats.rtt_min_ns);
+}
+
+/*
+ * Method used to process the cumulative ackno carried by any packet.
+ * Frees everything below it and refills the window from conn_input.
+ * Out of line, like fec_recvpkt, so rel_recvpkt stays small.
+ */
+static void __attribute__((noinline)) process_ack(rel_t *s, int ackno) {
+	if (s->stopAndWait) {
+		saw_process_ack(s, ackno);
+		return;
+	}
+	if (ackno <= s->sender.buffer_position || ackno > s->sender.last_frame_sent + 1) {
+		return;
+	}
+
+	// Sample the RTT off the newest packet this ack covers, or the
+	// timestamp it echoes, which is good even after a retransmission
+	struct WindowBuffer *newest = sender_slot(s, ackno - 1);
+	if (s->tsEcho) {
+		update_rtt(s, ts_elapsed(s, s->tsEcho));
+	} else if (!newest->retransmitted) {
+		update_rtt(s, conn_rxtime(s->c) - newest->timeStamp);
+	}
+
+	PROBE3(ack_advance, s, s->sender.buffer_position, ackno);
+	int i;
+	for (i = s->sender.buffer_position; i < ackno; i++) {
+		rtx_remove(s, i);
+		window_clear(s, s->senderWindow, i);
+	}
+	s->sender.buffer_position = ackno;
+	s->tlpSeqno = 0;
+	if (s->frtoState) {
+		frto_ack(s, ackno);
+	}
+
+	rel_read(s);
+}
+
+/*
+ * Method to open a new FEC group at seqno.  The group shrinks until it
+ * expects at most half a loss at the peer's reported loss rate, and
+ * gets a Q parity as well once one loss in it is no longer rare.
+ */
+static void fec_start_group(rel_t *s, int seqno) {
+	struct FecEncoder *f = &s->fecEncoder;
+	int size = f->groupSize;
+
+	if (f->reportedLoss > 0 && size * f->reportedLoss > 32768) {
+		size = 32768 / f->reportedLoss;
+		if (size < FEC_MIN_GROUP) {
+			size = FEC_MIN_GROUP < f->groupSize ? FEC_MIN_GROUP : f->groupSize;
+		}
+	}
+	f->first = seqno;
+	f->count = 0;
+	f->size = size;
+	f->parities = size * f->reportedLoss >= 6554 ? 2 : 1;
+	f->maxlen = 0;
+	f->plen = 0;
+	f->qlen = 0;
+	memset(f->p, 0, sizeof(f->p));
+	memset(f->q, 0, sizeof(f->q));
+}
+
+/*
+ * Method to send the parity of the open group.  Called when the group
+ * is full, or early when input runs dry so a short burst still gets
+ * its losses repaired without a timeout.
+ */
+static void fec_flush(rel_t *s) {
+	struct FecEncoder *f = &s->fecEncoder;
+	packet_t parity;
+	int i;
+
+	if (f->count == 0) {
+		return;
+	}
+	for (i = 0; i < f->parities; i++) {
+		int length = DATA_PACKET_HEADER + f->maxlen;
+		parity.len = length | FEC_FLAG;
+		parity.ackno = (i ? f->qlen : f->plen) << 16 | i << 8 | f->count;
+		parity.seqno = f->first;
+		memcpy(parity.data, i ? f->q : f->p, f->maxlen);
+		preparePacketForSending(&parity);
+		parity.cksum = 0;
+		parity.cksum = cksum(&parity, length);
+		s->stats.fec_sent++;
+		bucket_spend(s, length);
+		send_pkt(s, &parity, length);
+	}
+	f->count = 0;
+}
+
+/*
+ * Method to fold a new data packet's payload into the open group.
+ */
+static void fec_encode(rel_t *s, int seqno, const uint8_t *data, int data_size) {
+	struct FecEncoder *f = &s->fecEncoder;
+	int i, j;
+
+	if (f->count == 0) {
+		fec_start_group(s, seqno);
+	}
+	i = f->count++;
+	for (j = 0; j < data_size; j++) {
+		f->p[j] ^= data[j];
+	}
+	f->plen ^= data_size;
+	if (f->parities == 2) {
+		for (j = 0; j < data_size; j++) {
+			f->q[j] ^= gf_mul(data[j], i);
+		}
+		f->qlen ^= gf_mul16(data_size, i);
+	}
+	if (data_size > f->maxlen) {
+		f->maxlen = data_size;
+	}
+}
+
+/*
+ * The caller has already read data_size bytes into sendPacket.data
+ * and checked that the window has room for one more packet.
+ */
+static void send_data_pkt(rel_t *s, int data_size) {
+	if (s->stopAndWait) {
+		saw_send_pkt(s, data_size);
+		return;
+	}
+
+	//update sender state when a new data packet is sent
+	uint64_t now = conn_now();
+	int length = data_size + DATA_PACKET_HEADER;
+	if (data_size) {
+		latency_queued(s, now);
+	}
+	s->sender.last_frame_sent++;
+	s->sendPacket.len = length;
+	if (s->timestamps == TS_ON && data_size <= MAX_DATA_SIZE - TS_OPTION) {
+		length = ts_append(s, &s->sendPacket, length, now);
+		s->sendPacket.len = length | TS_FLAG;
+	}
+	s->sendPacket.seqno = s->sender.last_frame_sent;
+	s->sendPacket.ackno = s->receiver.buffer_position; //piggyback our cumulative ack
+
+	int positionInArray = s->sendPacket.seqno;
+	if (s->fecEncoder.groupSize) {
+		fec_encode(s, positionInArray, (uint8_t *) s->sendPacket.data, data_size);
+	}
+	preparePacketForSending(&(s->sendPacket));
+	s->sendPacket.cksum = 0;
+	s->sendPacket.cksum = cksum(&s->sendPacket, length);
+
+	//prepare a copy of the packet along with other state to store in sender buffer
+	packet_t *sendingPacketCopy = packet_alloc();
+	memcpy(sendingPacketCopy, &s->sendPacket, length);
+	struct WindowBuffer *packetBuffer = window_fill(s, &s->senderWindow, positionInArray);
+	packetBuffer->isFull = 1;
+	packetBuffer->ptr = sendingPacketCopy;
+	packetBuffer->timeStamp = now;
+	s->lastActive = now;
+	arm_timer(s, packetBuffer->timeStamp + (probe_allowed(s) ? probe_timeout(s) : s->timeout));
+	packetBuffer->acknowledged = 0;
+	packetBuffer->retransmitted = 0;
+	rtx_append(s, positionInArray);
+	s->stats.data_sent++;
+	bucket_spend(s, length);
+
+	//send the packet over network
+	send_pkt(s, sendingPacketCopy, length);
+	if (s->timestamps == TS_OFFERED) {
+		ts_offer(s);
+	}
+
+	if (s->fecEncoder.groupSize && s->fecEncoder.count == s->fecEncoder.size) {
+		fec_flush(s);
+	}
+}
+
+/*
+ * Method to send our loss estimate back to a sender using FEC.
+ */
+static void send_fec_report(rel_t *r) {
+	packet_t report;
+	report.len = ACK_PACKET_HEADER | FEC_FLAG;
+	report.ackno = r->fecDecoder->loss;
+	report.seqno = 0;
+	preparePacketForSending(&report);
+	report.cksum = 0;
+	report.cksum = cksum(&report, ACK_PACKET_HEADER);
+	send_pkt(r, &report, ACK_PACKET_HEADER);
+}
+
+/*
+ * Returns the stored copy of seqno, or NULL if it has not arrived.
+ * Sets *gone if it was delivered too long ago to still be held.
+ */
+static packet_t *fec_lookup(rel_t *r, int seqno, int *gone) {
+	if (seqno >= r->receiver.buffer_position) {
+		struct WindowBuffer *slot = window_lookup(r, r->receiverWindow, seqno);
+		return slot && slot->isFull ? slot->ptr : NULL;
+	}
+	packet_t *old = r->fecDecoder->history[seqno % FEC_HISTORY];
+	if (!old || old->seqno != seqno) {
+		*gone = 1;
+	}
+	return old;
+}
+
+/*
+ * Method to rebuild the missing packets of a group once its parity
+ * covers them: one loss from either P or Q, two from both.
+ */
+static void fec_decode(rel_t *r, int first, int count) {
+	struct FecDecoder *d = r->fecDecoder;
+	struct FecParity *p = NULL, *q = NULL;
+	uint8_t pacc[MAX_DATA_SIZE], qacc[MAX_DATA_SIZE];
+	uint16_t plen = 0, qlen = 0;
+	int missing[2], nmissing = 0, gone = 0;
+	int i, j, len = 0;
+
+	for (i = 0; i < FEC_PENDING; i++) {
+		struct FecParity *parity = &d->pending[i];
+		if (parity->isFull && parity->first == first && parity->count == count) {
+			if (parity->index) {
+				q = parity;
+			} else {
+				p = parity;
+			}
+			len = parity->len;
+		}
+	}
+	if (!p && !q) {
+		return;
+	}
+	if (p) {
+		memcpy(pacc, p->data, len);
+		plen = p->codedLen;
+	}
+	if (q) {
+		memcpy(qacc, q->data, len);
+		qlen = q->codedLen;
+	}
+
+	// Strip every packet we have out of the parity
+	for (i = 0; i < count && !gone; i++) {
+		packet_t *pkt = fec_lookup(r, first + i, &gone);
+		if (gone) {
+			break;
+		}
+		if (!pkt) {
+			if (nmissing == 2) {
+				return;	//more losses than parity; wait for retransmissions
+			}
+			missing[nmissing++] = i;
+			continue;
+		}
+		int payload = pkt->len - DATA_PACKET_HEADER;
+		if (p) {
+			for (j = 0; j < len; j++) {
+				pacc[j] ^= pkt->data[j];
+			}
+			plen ^= payload;
+		}
+		if (q) {
+			for (j = 0; j < len; j++) {
+				qacc[j] ^= gf_mul(pkt->data[j], i);
+			}
+			qlen ^= gf_mul16(payload, i);
+		}
+	}
+	if (!gone && nmissing > (p != NULL) + (q != NULL)) {
+		return;
+	}
+	if (!gone && nmissing > 0
+			&& first + missing[nmissing - 1] >= r->receiver.buffer_position + r->windowSize) {
+		return;	//no room to store it yet
+	}
+
+	// The group is finished with either way
+	if (p) {
+		p->isFull = 0;
+	}
+	if (q) {
+		q->isFull = 0;
+	}
+	if (gone || nmissing == 0) {
+		return;
+	}
+
+	// Solve for the missing payloads in place in pacc (and qacc)
+	int x = missing[0];
+	if (nmissing == 1 && !p) {
+		int inv = (255 - x) % 255;
+		for (j = 0; j < len; j++) {
+			pacc[j] = gf_mul(qacc[j], inv);
+		}
+		plen = gf_mul16(qlen, inv);
+	} else if (nmissing == 2) {
+		// D_x = (Q' + g^y P') / (g^x + g^y), D_y = P' + D_x
+		int y = missing[1];
+		int inv = 255 - gf_log[gf_exp[x] ^ gf_exp[y]];
+		for (j = 0; j < len; j++) {
+			qacc[j] = gf_mul(qacc[j] ^ gf_mul(pacc[j], y), inv);
+			pacc[j] ^= qacc[j];
+		}
+		qlen = gf_mul16(qlen ^ gf_mul16(plen, y), inv);
+		plen ^= qlen;
+	}
+
+	// Hand the rebuilt packets to the normal receive path
+	for (i = 0; i < nmissing; i++) {
+		uint8_t *data = (nmissing == 2 && i == 0) ? qacc : pacc;
+		int payload = (nmissing == 2 && i == 0) ? qlen : plen;
+		packet_t rebuilt;
+		if (payload > len) {
+			return;	//corrupt parity
+		}
+		memset(&rebuilt, 0, sizeof(rebuilt));
+		rebuilt.len = DATA_PACKET_HEADER + payload;
+		rebuilt.seqno = first + missing[i];
+		memcpy(rebuilt.data, data, payload);
+		r->stats.fec_recovered++;
+		receive_data(r, &rebuilt);
+	}
+}
+
+/*
+ * Method to account for a group's first parity packet in the loss
+ * estimate that goes back to the sender.
+ */
+static void fec_sample_loss(rel_t *r, int first, int count) {
+	struct FecDecoder *d = r->fecDecoder;
+	int i, gone = 0, missing = 0;
+
+	if (first <= d->lastGroup) {
+		return;
+	}
+	d->lastGroup = first;
+	for (i = 0; i < count; i++) {
+		if (first + i >= r->receiver.buffer_position && !fec_lookup(r, first + i, &gone)) {
+			missing++;
+		}
+	}
+	d->loss += (missing * 65536 / count - d->loss) / 8;
+	if (++d->groupsSinceReport >= FEC_REPORT_GROUPS) {
+		d->groupsSinceReport = 0;
+		send_fec_report(r);
+	}
+}
+
+/*
+ * Method to handle a packet with FEC_FLAG set, already in host order
+ * with the flag stripped from len.
+ */
+static void __attribute__((noinline)) fec_recvpkt(rel_t *r, packet_t *pkt) {
+	struct FecDecoder *d = r->fecDecoder;
+
+	// A loss report for our own parity
+	if (pkt->len == ACK_PACKET_HEADER) {
+		r->fecEncoder.reportedLoss = pkt->ackno > 65536 ? 65536 : pkt->ackno;
+		return;
+	}
+
+	r->stats.fec_recv++;
+	int first = pkt->seqno;
+	int count = pkt->ackno & 0xff;
+	int index = pkt->ackno >> 8 & 0xff;
+	if (first < 1 || count < 1 || index > 1) {
+		r->stats.bad_len++;
+		return;
+	}
+	if (!d) {
+		// Turns on history, so parity can rebuild next to delivered packets
+		d = r->fecDecoder = xmalloc(sizeof(*d));
+		memset(d, 0, sizeof(*d));
+		mem_charge(sizeof(*d));
+	}
+	fec_sample_loss(r, first, count);
+
+	// Nothing to rebuild if the group was delivered or is too far ahead
+	if (first + count <= r->receiver.buffer_position
+			|| first >= r->receiver.buffer_position + r->windowSize) {
+		return;
+	}
+
+	// Keep it, evicting the oldest group if every slot is taken
+	int i, victim = 0;
+	for (i = 0; i < FEC_PENDING; i++) {
+		if (!d->pending[i].isFull) {
+			victim = i;
+			break;
+		}
+		if (d->pending[i].first < d->pending[victim].first) {
+			victim = i;
+		}
+	}
+	struct FecParity *parity = &d->pending[victim];
+	parity->isFull = 1;
+	parity->first = first;
+	parity->count = count;
+	parity->index = index;
+	parity->len = pkt->len - DATA_PACKET_HEADER;
+	parity->codedLen = pkt->ackno >> 16;
+	memcpy(parity->data, pkt->data, parity->len);
+
+	fec_decode(r, first, count);
+}
+
+
+void rel_recvpkt(rel_t *r, packet_t *pkt, size_t n) {
+
+	// Drop anything truncated, oversized or of an impossible length
+	if (n < ACK_PACKET_HEADER) {
+		r->stats.bad_len++;
+		return;
+	}
+	int length = ntohs(pkt->len) & ~(FEC_FLAG | TS_FLAG);
+	int isFec = ntohs(pkt->len) & FEC_FLAG;
+	int option = ntohs(pkt->len) & TS_FLAG ? TS_OPTION : 0;
+	if (length > n || length > sizeof(*pkt) || (isFec && option)
+			|| (length - option != ACK_PACKET_HEADER && length - option < DATA_PACKET_HEADER)) {
+		r->stats.bad_len++;
+		return;
+	}
+
+	// Compare checksums to detect packet corruption
+	int checksum = pkt->cksum;
+	pkt->cksum = 0;
+	int compare_checksum = cksum(pkt, length);
+	if (compare_checksum != checksum) {
+		r->stats.bad_cksum++;
+		conn_trace(r->c, TRACE_BAD_CKSUM, pkt, n);
+		PROBE2(cksum_fail, r, n);
+		return;
+	}
+	// Take the option off before an ack's seqno field, which it
+	// overlaps, is converted
+	uint32_t ts[2];
+	if (option) {
+		length -= option;
+		memcpy(ts, (char *) pkt + length, TS_OPTION);
+	}
+	convertPacketFromNetworkByteOrder(pkt);
+	pkt->len = length;
+	PROBE4(recv, r, pkt->ackno, pkt->seqno, length);
+	r->tsEcho = 0;
+	if (option && !ts_receive(r, pkt, ntohl(ts[0]), ntohl(ts[1]))) {
+		return;
+	}
+
+	// Parity and loss reports carry no ack
+	if (isFec) {
+		fec_recvpkt(r, pkt);
+		close_if_done(r);
+		return;
+	}
+
+	// Every packet carries a cumulative ack
+	process_ack(r, pkt->ackno);
+
+	// CASE 1: ACK packet
+	if (pkt->len == ACK_PACKET_HEADER) {
+		r->stats.acks_recv++;
+	} else {
+		// CASE 2: DATA packet
+		r->stats.data_recv++;
+		receive_data(r, pkt);
+	}
+	close_if_done(r);
+}
+
+/*
+ * Method to buffer and deliver a data packet, whether it came off the
+ * network or was rebuilt from parity.
+ */
+static void receive_data(rel_t *r, packet_t *pkt) {
+	if (r->stopAndWait && saw_receive_data(r, pkt)) {
+		return;
+	}
+
+	// Already delivered: the ack for it must have been dropped. Retransmit.
+	if (pkt->seqno < r->receiver.buffer_position) {
+		r->stats.dup_recv++;
+		trace_event(r, TRACE_DUP, pkt);
+		retransmit_ack(r, r->receiver.buffer_position);
+		return;
+	}
+
+	// Outside the receiver's window
+	if (pkt->seqno >= r->windowSize + r->receiver.buffer_position) {
+		r->stats.out_of_window++;
+		trace_event(r, TRACE_OUT_OF_WINDOW, pkt);
+		return;
+	}
+
+	// You are getting duplicate packets by nature of cumulative ack
+	struct WindowBuffer *packetBuffer = window_lookup(r, r->receiverWindow, pkt->seqno);
+	if (packetBuffer && packetBuffer->isFull == 1) {
+		r->stats.dup_recv++;
+		trace_event(r, TRACE_DUP, pkt);
+		retransmit_ack(r, r->receiver.buffer_position);
+		return;
+	}
+
+	// Over the memory budget the window shrinks to the next packet due
+	if (pkt->seqno != r->receiver.buffer_position && !mem_allows_packet()) {
+		r->stats.out_of_window++;
+		trace_event(r, TRACE_OUT_OF_WINDOW, pkt);
+		return;
+	}
+
+	// Clear out the old data from the packet buffer
+	int start = pkt->len - DATA_PACKET_HEADER;
+	memset(pkt->data + start, 0, MAX_DATA_SIZE - start);
+
+	// The buffer rlib received into becomes the slot's; others are copied
+	packet_t *receivingPacketCopy = pkt;
+	if (pkt == rxSpare) {
+		rxSpare = NULL;
+	} else {
+		receivingPacketCopy = packet_alloc();
+		memcpy(receivingPacketCopy, pkt, sizeof (struct packet));
+	}
+	packetBuffer = window_fill(r, &r->receiverWindow, pkt->seqno);
+	packetBuffer->isFull = 1;
+	packetBuffer->ptr = receivingPacketCopy;
+	packetBuffer->timeStamp = conn_rxtime(r->c);
+	r->lastActive = packetBuffer->timeStamp;
+	if (r->idle) {
+		arm_timer(r, r->lastActive + r->idle);
+	}
+
+	/* when you receive the correct seqno you have been expecting,
+	 * recompute what the new ack should be */
+	if (r->receiver.last_frame_received == pkt->seqno) {
+		r->receiver.last_frame_received = compute_LFR(r);
+	}
+	if (pkt->seqno >= r->receiver.highest_seen) {
+		r->receiver.highest_seen = pkt->seqno + 1;
+	}
+	if (r->streams) {
+		stream_park(r, pkt->seqno);
+	}
+
+	// This may complete a group whose parity is waiting
+	if (r->fecDecoder) {
+		int i;
+		for (i = 0; i < FEC_PENDING; i++) {
+			struct FecParity *parity = &r->fecDecoder->pending[i];
+			if (parity->isFull && pkt->seqno >= parity->first
+					&& pkt->seqno < parity->first + parity->count) {
+				fec_decode(r, parity->first, parity->count);
+			}
+		}
+	}
+
+	int previousAck = r->receiver.max_ack;
+	output_data(r);
+
+	// Out of order (or output blocked): repeat the current ack
+	if (r->receiver.max_ack == previousAck) {
+		retransmit_ack(r, r->receiver.buffer_position);
+	}
+}
+
+void rel_getstats(rel_t *r, struct rel_stats *stats) {
+	*stats = r->stats;
+	if (r->bucket.throttledSince) {
+		stats->throttle_ns += conn_now() - r->bucket.throttledSince;
+	}
+	stats->window = r->windowSize;
+	stats->in_flight = r->sender.last_frame_sent + 1 - r->sender.buffer_position;
+	stats->rcv_pending = r->receiver.last_frame_received - r->receiver.buffer_position;
+}
+
+/*
+ * Method to read framed input in multi-stream mode.  Each packet holds
+ * bytes of one record, behind its stream id and stream seqno.
+ */
+static int stream_input(rel_t *s) {
+	struct StreamInput *in = &s->streamInput;
+	uint8_t *data = (uint8_t *) s->sendPacket.data;
+	int n;
+
+	for (;;) {
+		// Between records: read the next header
+		if (in->remaining == 0) {
+			n = conn_input(s->c, in->header + in->headerBytes, STREAM_HEADER - in->headerBytes);
+			if (n <= 0) {
+				return n;
+			}
+			in->headerBytes += n;
+			if (in->headerBytes == STREAM_HEADER) {
+				in->headerBytes = 0;
+				in->stream = in->header[0] << 8 | in->header[1];
+				in->remaining = in->header[2] << 8 | in->header[3];
+				in->discard = in->stream >= s->streams;
+				if (in->discard) {
+					fprintf(stderr, "%s: input for stream %d, but only %d streams\n",
+							progname, in->stream, s->streams);
+				}
+			}
+			continue;
+		}
+
+		n = max_payload(s) - STREAM_HEADER;
+		if (in->remaining < n) {
+			n = in->remaining;
+		}
+		n = conn_input(s->c, data + STREAM_HEADER, n);
+		if (n <= 0) {
+			return n;
+		}
+		in->remaining -= n;
+		if (!in->discard) {
+			break;
+		}
+	}
+
+	uint16_t seq = s->streamSent[in->stream]++;
+	data[0] = in->stream >> 8;
+	data[1] = in->stream;
+	data[2] = seq >> 8;
+	data[3] = seq;
+	return n + STREAM_HEADER;
+}
+
+/*
+ * Method to note that rel_read is leaving input unread, for LAT_QUEUE.
+ * The window may as well be full with no input waiting; the next read
+ * then finds none and the mark is dropped.  Having just sent, the send
+ * time saves reading the clock.
+ */
+static void input_blocked(rel_t *s, int sent) {
+	if (s->inputBlocked) {
+		return;
+	}
+	if (!sent) {
+		s->inputBlocked = conn_now();
+	} else if (s->stopAndWait) {
+		s->inputBlocked = s->sawSentAt;
+	} else {
+		s->inputBlocked = sender_slot(s, s->sender.last_frame_sent)->timeStamp;
+	}
+}
+
+void rel_read(rel_t *s) {
+	int data_size = 0;
+	int sent = 0;
+
+	// Input has ended and our EOF is out
+	if (s->finSeqno) {
+		return;
+	}
+
+	// Only pull input while the window has room, so nothing read is dropped
+	while (s->sender.last_frame_sent + 1 < s->sender.buffer_position + s->windowSize) {
+		if (!bucket_allows(s)) {
+			PROBE2(window_stall, s, STALL_RATE);
+			input_blocked(s, sent);
+			return;
+		}
+		// Over the memory budget, keep one packet in flight at most
+		if (!mem_allows_packet() && s->sender.last_frame_sent >= s->sender.buffer_position) {
+			PROBE2(window_stall, s, STALL_MEMORY);
+			input_blocked(s, sent);
+			return;
+		}
+		if (s->streams) {
+			data_size = stream_input(s);
+		} else {
+			data_size = conn_input(s->c, s->sendPacket.data, max_payload(s));
+		}
+		if (data_size <= 0) {
+			s->inputBlocked = 0;
+			// EOF: a data packet with no payload, retransmitted like any other
+			if (data_size < 0) {
+				send_data_pkt(s, 0);
+				s->finSeqno = s->sender.last_frame_sent;
+			}
+			if (s->fecEncoder.groupSize) {
+				fec_flush(s);
+			}
+			return;
+		}
+		send_data_pkt(s, data_size);
+		sent = 1;
+	}
+	PROBE2(window_stall, s, STALL_WINDOW);
+	input_blocked(s, sent);
+}
+
+/*
+ * Method to free the slot at buffer_position once its data is out,
+ * moving the packet into the FEC history if parity may still need it.
+ */
+static void release_slot(rel_t *r) {
+	struct WindowBuffer *packet = receiver_slot(r, r->receiver.buffer_position);
+	if (r->fecDecoder && mem_allows_packet()) {
+		// Keep it: a later parity may need it to rebuild a neighbour
+		packet_t **old = &r->fecDecoder->history[r->receiver.buffer_position % FEC_HISTORY];
+		packet_free(*old);
+		*old = packet->ptr;
+		packet->ptr = NULL;
+	}
+	window_clear(r, r->receiverWindow, r->receiver.buffer_position);
+	r->receiver.buffer_position++;
+}
+
+// How far a buffered packet's stream seqno is past the next one due
+static int stream_ahead(rel_t *r, const struct WindowBuffer *packet) {
+	const uint8_t *data = (const uint8_t *) packet->ptr->data;
+	return (int16_t) ((data[2] << 8 | data[3]) - r->streamNext[data[0] << 8 | data[1]]);
+}
+
+/*
+ * Method to queue a packet that has just been buffered in multi-stream
+ * mode on its stream, where stream_output finds it once it is next.
+ * Packets mostly arrive in order, so the search starts at the tail.
+ */
+static void stream_park(rel_t *r, int seqno) {
+	struct WindowBuffer *packet = receiver_slot(r, seqno);
+	if (packet->ptr->len == DATA_PACKET_HEADER) {
+		return;	//EOF waits for everything before it, in stream_output
+	}
+	uint8_t *data = (uint8_t *) packet->ptr->data;
+	int payload = packet->ptr->len - DATA_PACKET_HEADER - STREAM_HEADER;
+	int stream = data[0] << 8 | data[1];
+	if (payload < 0 || stream >= r->streams) {
+		packet->outputted = 1;	//malformed; drop it
+		return;
+	}
+	int ahead = stream_ahead(r, packet);
+	if (ahead < 0) {
+		packet->outputted = 1;	//stale; drop it
+		return;
+	}
+
+	struct StreamQueue *q = &r->streamQueue[stream];
+	int *link = &q->head;
+	if (q->tail && stream_ahead(r, receiver_slot(r, q->tail)) <= ahead) {
+		link = &receiver_slot(r, q->tail)->streamLink;
+	} else {
+		while (*link && stream_ahead(r, receiver_slot(r, *link)) <= ahead) {
+			link = &receiver_slot(r, *link)->streamLink;
+		}
+	}
+	packet->streamLink = *link;
+	*link = seqno;
+	if (!packet->streamLink) {
+		q->tail = seqno;
+	}
+
+	if (ahead == 0 && !q->ready) {
+		q->ready = 1;
+		q->readyNext = -1;
+		if (r->streamReadyTail >= 0) {
+			r->streamQueue[r->streamReadyTail].readyNext = stream;
+		} else {
+			r->streamReady = stream;
+		}
+		r->streamReadyTail = stream;
+	}
+}
+
+/*
+ * Method to deliver in multi-stream mode.  Any buffered packet that is
+ * next on its own stream goes out as a record, even past a hole in the
+ * shared sequence space; the slots are only released (and acked) once
+ * everything before them is out too.  Only streams stream_park has
+ * found a packet due on are looked at, so each arrival costs the
+ * packets it lets out rather than a pass over the window.
+ */
+static void stream_output(rel_t *r) {
+	uint8_t frame[MAX_DATA_SIZE];
+	struct WindowBuffer *next;
+	uint64_t now = 0;
+
+	while (r->streamReady >= 0) {
+		int stream = r->streamReady;
+		struct StreamQueue *q = &r->streamQueue[stream];
+		while (q->head) {
+			struct WindowBuffer *packet = receiver_slot(r, q->head);
+			int ahead = stream_ahead(r, packet);
+			if (ahead > 0) {
+				break;	//an earlier packet on this stream is missing
+			}
+			if (ahead == 0) {
+				uint8_t *data = (uint8_t *) packet->ptr->data;
+				int payload = packet->ptr->len - DATA_PACKET_HEADER - STREAM_HEADER;
+				if (conn_bufspace(r->c) < payload + STREAM_HEADER) {
+					PROBE2(output_blocked, r, payload + STREAM_HEADER);
+					goto release;	//stream stays first on the ready list
+				}
+				frame[0] = stream >> 8;
+				frame[1] = stream;
+				frame[2] = payload >> 8;
+				frame[3] = payload;
+				memcpy(frame + STREAM_HEADER, data + STREAM_HEADER, payload);
+				conn_output(r->c, frame, payload + STREAM_HEADER);
+				if (!now) {
+					now = conn_now();
+				}
+				latency_delivered(r, packet->timeStamp, now);
+				r->streamNext[stream]++;
+			}
+			packet->outputted = 1;	//delivered, or a stale duplicate dropped
+			q->head = packet->streamLink;
+			if (!q->head) {
+				q->tail = 0;
+			}
+		}
+		q->ready = 0;
+		r->streamReady = q->readyNext;
+		if (r->streamReady < 0) {
+			r->streamReadyTail = -1;
+		}
+	}
+
+release:
+	while ((next = window_lookup(r, r->receiverWindow, r->receiver.buffer_position))
+			&& next->outputted) {
+		release_slot(r);
+	}
+
+	// EOF goes out once everything before it has
+	if (next && next->isFull && next->ptr->len == DATA_PACKET_HEADER) {
+		conn_output(r->c, NULL, 0);
+		r->peerFinished = 1;
+		release_slot(r);
+	}
+}
+
+/*
+ * Method to hand received data to conn_output, from rel_output or as
+ * packets arrive.  Nothing is output after the peer's EOF.
+ */
+static void output_data(rel_t *r) {
+
+	if (r->streams && !r->peerFinished) {
+		stream_output(r);
+	}
+
+	// Deliver in order, stopping at the first hole or when output is full
+	uint64_t now = 0;
+	while (!r->streams && !r->peerFinished
+			&& r->receiver.buffer_position < r->receiver.last_frame_received) {
+		struct WindowBuffer *packet = receiver_slot(r, r->receiver.buffer_position);
+		int payload = packet->ptr->len - DATA_PACKET_HEADER;
+		if (conn_bufspace(r->c) < payload) {
+			PROBE2(output_blocked, r, payload);
+			break;
+		}
+		conn_output(r->c, packet->ptr->data, payload);
+		if (!now) {
+			now = conn_now();
+		}
+		latency_delivered(r, packet->timeStamp, now);
+		if (payload == 0) {
+			r->peerFinished = 1;
+		}
+		release_slot(r);
+	}
+
+	// Acknowledge only what conn_output has accepted
+	if (r->receiver.buffer_position > r->receiver.max_ack) {
+		r->receiver.max_ack = r->receiver.buffer_position;
+		retransmit_ack(r, r->receiver.max_ack);
+	}
+
+	// The window may now reach packets that arrived early
+	r->receiver.last_frame_received = compute_LFR(r);
+}
+
+/*
+ * Method to end the connection once both directions are finished: our
+ * EOF acknowledged and the peer's output.  Our ack of the peer's EOF
+ * may yet be lost, so the peer must still get an answer if it resends:
+ * a server connection leaves a TIME_WAIT record, any other lingers
+ * TIME_WAIT_RTOS timeouts itself, re-acking as receive_data does any
+ * duplicate, before rel_timer destroys it.  Only called where nothing
+ * up the stack still uses r.
+ */
+static int close_if_done(rel_t *r) {
+	if (r->lingerUntil || !r->finSeqno || r->sender.buffer_position <= r->finSeqno
+			|| !r->peerFinished) {
+		return 0;
+	}
+	if (time_wait_add(r)) {
+		rel_destroy(r);
+		return 1;
+	}
+	r->lingerUntil = conn_now() + TIME_WAIT_RTOS * r->timeout;
+	arm_timer(r, r->lingerUntil);
+	lingerCount++;
+	return 0;
+}
+
+void rel_output(rel_t *r) {
+	output_data(r);
+	close_if_done(r);
+}
+
+/*
+ * Stop-and-wait fast path, chosen in initialize for a window of 1
+ * without FEC or streams.  The one packet in flight is sendPacket
+ * itself, which rel_read cannot refill until it is acked, and an
+ * expected packet goes straight from the network buffer to
+ * conn_output, so neither window array is ever allocated.  Anything
+ * else (output blocked, FEC parity from the peer) takes the generic
+ * path, which this one leaves in a consistent state.
+ */
+static void saw_send_pkt(rel_t *s, int data_size) {
+	packet_t *pkt = &s->sendPacket;
+	int length = data_size + DATA_PACKET_HEADER;
+
+	s->sender.last_frame_sent++;
+	s->sawSentAt = conn_now();
+	if (data_size) {
+		latency_queued(s, s->sawSentAt);
+	}
+	pkt->len = htons(length);
+	if (s->timestamps == TS_ON && data_size <= MAX_DATA_SIZE - TS_OPTION) {
+		length = ts_append(s, pkt, length, s->sawSentAt);
+		pkt->len = htons(length | TS_FLAG);
+	}
+	pkt->ackno = htonl(s->receiver.buffer_position);
+	pkt->seqno = htonl(s->sender.last_frame_sent);
+	pkt->cksum = 0;
+	pkt->cksum = cksum(pkt, length);
+	s->sawRetransmitted = 0;
+	s->lastActive = s->sawSentAt;
+	arm_timer(s, s->sawSentAt + (probe_allowed(s) ? probe_timeout(s) : s->timeout));
+	s->stats.data_sent++;
+	bucket_spend(s, length);
+	send_pkt(s, pkt, length);
+	if (s->timestamps == TS_OFFERED) {
+		ts_offer(s);
+	}
+}
+
+static void saw_process_ack(rel_t *s, int ackno) {
+	if (ackno != s->sender.buffer_position + 1 || s->sender.last_frame_sent != s->sender.buffer_position) {
+		return;
+	}
+	if (s->tsEcho) {
+		update_rtt(s, ts_elapsed(s, s->tsEcho));
+	} else if (!s->sawRetransmitted) {
+		update_rtt(s, conn_rxtime(s->c) - s->sawSentAt);
+	}
+	PROBE3(ack_advance, s, s->sender.buffer_position, ackno);
+	s->sender.buffer_position = ackno;
+	s->tlpSeqno = 0;
+	if (s->frtoState) {
+		frto_ack(s, ackno);
+	}
+	rel_read(s);
+}
+
+// Returns 0 to leave the packet to receive_data
+static int saw_receive_data(rel_t *r, packet_t *pkt) {
+	int payload = pkt->len - DATA_PACKET_HEADER;
+
+	if (pkt->seqno != r->receiver.buffer_position || r->receiver.highest_seen != pkt->seqno
+			|| r->peerFinished || r->fecDecoder || conn_bufspace(r->c) < payload) {
+		return 0;
+	}
+	uint64_t arrived = conn_rxtime(r->c);
+	uint64_t now = conn_now();
+	conn_output(r->c, pkt->data, payload);
+	latency_delivered(r, arrived, now);
+	if (payload == 0) {
+		r->peerFinished = 1;
+	}
+	r->receiver.buffer_position++;
+	r->receiver.highest_seen = r->receiver.buffer_position;
+	r->receiver.last_frame_received = r->receiver.buffer_position;
+	r->receiver.max_ack = r->receiver.buffer_position;
+	if (r->idle) {
+		r->lastActive = now;
+		arm_timer(r, r->lastActive + r->idle);
+	}
+	retransmit_ack(r, r->receiver.max_ack);
+	return 1;
+}
+
+static void saw_retransmit(rel_t *r, uint64_t now) {
+	int length = ntohs(r->sendPacket.len) & ~TS_FLAG;
+
+	if (ntohs(r->sendPacket.len) & TS_FLAG) {
+		ts_restamp(r, &r->sendPacket, length, now);
+	}
+	r->sawSentAt = now;
+	r->sawRetransmitted = 1;
+	r->stats.retransmits++;
+	bucket_spend(r, length);
+	conn_trace(r->c, TRACE_RETRANSMIT, &r->sendPacket, length);
+	PROBE3(retransmit, r, r->sender.last_frame_sent, length);
+	send_pkt(r, &r->sendPacket, length);
+	if (r->sender.last_frame_sent == r->finSeqno && r->peerFinished) {
+		r->finRetries++;
+	}
+}
+
+// The packet in flight is always the tail, so it gets the probe too
+static void saw_timer(rel_t *r, uint64_t now) {
+	if (r->sender.last_frame_sent < r->sender.buffer_position) {
+		return;
+	}
+	if (now - r->sawSentAt >= r->timeout) {
+		r->stats.timeouts++;
+		r->frtoState = 1;
+		r->frtoSeqno = r->sender.last_frame_sent;
+		r->frtoSentAt = now;
+		saw_retransmit(r, now);
+	} else if (probe_allowed(r)) {
+		if (now - r->sawSentAt >= probe_timeout(r)) {
+			r->stats.tlp_probes++;
+			r->tlpSeqno = r->sender.last_frame_sent;
+			saw_retransmit(r, now);
+		} else {
+			arm_timer(r, r->sawSentAt + probe_timeout(r));
+		}
+	}
+	arm_timer(r, r->sawSentAt + r->timeout);
+}
+
+uint64_t rel_deadline() {
+	uint64_t when = timerCount ? timerHeap[1]->deadline : 0;
+	if (timeWaitHead && (!when || timeWaitHead->expires < when)) {
+		return timeWaitHead->expires;
+	}
+	return when;
+}
+
+void rel_timer() {
+	/* Retransmit any packets that need to be retransmitted */
+	rel_t *r, *due = NULL;
+	uint64_t now = conn_now();
+
+	time_wait_expire(now);
+
+	// Take every connection that is due off the heap before running
+	// any: each arms again what it still needs, which may be now
+	while (timerCount && timerHeap[1]->deadline <= now) {
+		r = timerHeap[1];
+		timer_remove(r);
+		r->timerNext = due;
+		due = r;
+	}
+	while ((r = due)) {
+		due = r->timerNext;
+		if (r->lingerUntil) {
+			if (now >= r->lingerUntil) {
+				rel_destroy(r);
+			} else {
+				arm_timer(r, r->lingerUntil);
+			}
+			continue;
+		}
+		if (r->stopAndWait) {
+			saw_timer(r, now);
+		} else {
+			retransmit_timer(r, now);
+		}
+		// The peer has finished and stopped acking: it has gone
+		if (r->finRetries > FIN_RETRIES) {
+			rel_destroy(r);
+			continue;
+		}
+		if (r->bucket.throttledSince) {
+			if (now >= r->bucket.wakeup) {
+				rel_read(r);
+			} else {
+				arm_timer(r, r->bucket.wakeup);
+			}
+		}
+		if (r->idle && (r->senderWindow || r->receiverWindow || r->fecDecoder)) {
+			if (!rel_busy(r) && now - r->lastActive >= r->idle) {
+				rel_reclaim(r);
+			} else {
+				// Busy ones are looked at again an idle period from now
+				arm_timer(r, (rel_busy(r) ? now : r->lastActive) + r->idle);
 			}
 		}
 	}
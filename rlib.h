@@ -57,6 +57,35 @@
    - data:  Contains (len - 12) bytes of payload data for the
             application.
 
+   FEC mode (-F) adds a third kind, flagged by setting FEC_FLAG in
+   len.  A flagged packet of len 8 is a loss report from a receiver;
+   its ackno is the fraction of packets it has been missing, in units
+   of 1/65536.  Any longer flagged packet is a parity packet: seqno is
+   the first seqno of the group it covers, ackno packs the group size
+   (low 8 bits), the parity index (bit 8, 0 for XOR and 1 for the
+   Reed-Solomon Q syndrome) and the coded payload lengths (top 16
+   bits), and data is the parity of the group's payloads, each
+   zero-padded to the longest.  Flagged packets carry no ack.
+
+   With --timestamps a packet may also end in an 8-byte timestamp
+   option, flagged by setting TS_FLAG in len; len then counts the
+   option, which follows the header of an Ack or the payload of a Data
+   packet.  It holds tsval, the sender's clock in microseconds, and
+   tsecr, the tsval of the last in-order Data packet the sender
+   received (0 for none), both big-endian.  A side only adds the option
+   once the peer has sent a flagged packet.  Until then it offers with
+   a few extra flagged Ack packets, which a peer that does not
+   understand them drops as malformed.  Parity and loss reports never
+   carry the option.
+
+   In multi-stream mode (-m) both ends carry up to 65536 ordered
+   streams over the one connection.  The data of every Data packet
+   then starts with a 16-bit stream id and a 16-bit per-stream
+   sequence number, and the application side of the connection is
+   framed: input and output are records of a 16-bit stream id, a 16-bit
+   length and that many bytes.  Packets of each stream are delivered
+   in order, but loss on one stream does not hold up the others.
+
    To conserve packets, a sender should not send more than one
    unacknowledged Data frame with less than the maximum number of
    packets (500), somewhat like TCP's Nagle algorithm.
@@ -80,6 +109,9 @@ struct packet {
 };
 typedef struct packet packet_t;
 
+#define FEC_FLAG 0x8000		/* in len: parity or loss report */
+#define TS_FLAG 0x4000		/* in len: ends in the timestamp option */
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -171,20 +203,28 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * The function rel_timer is called once the time returned by
+     rel_deadline has passed.  You can use this timer to inspect
+     packets and retransmit packets that have not been acknowledged.
+     Do not retransmit every packet every time the timer is fired!
+     You must keep track of which packets need to be retransmitted
+     when.  The library sleeps while rel_deadline returns 0, so an
+     idle connection costs no wakeups.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rel_timer called in milliseconds */
+  int timer;			/* How often -l logs are flushed, in ms */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
+  int fec;			/* Data packets per FEC group, 0 for none */
+  int streams;			/* Framed multi-stream mode if non-zero */
+  uint64_t rate;		/* Send rate limit in bytes/s, 0 for none */
+  uint64_t burst;		/* Token bucket size in bytes */
+  int idle;			/* ms quiet before buffers are freed, 0 never */
+  uint64_t mem_budget;		/* bytes for all connections, 0 for no limit */
+  int timestamps;		/* offer the timestamp option */
 };
 
 typedef struct reliable_state rel_t;
@@ -252,6 +292,133 @@ int conn_input (conn_t *c, void *buf, size_t len);
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* Send a packet to a peer that no longer has a conn_t, over the
+ * server's shared UDP socket.  Returns -1 when there is no such socket
+ * (clients and stand-alone mode). */
+int conn_sendto (const struct sockaddr_storage *ss,
+		 const packet_t *pkt, size_t len);
+
+/* Binary packet trace, enabled with -T.  Each event is a fixed-size
+ * record in an in-memory ring, written to <pid>.trace at exit or on
+ * SIGUSR2 and decoded by tracedump.  Header fields are kept in network
+ * byte order, exactly as on the wire. */
+enum trace_event {
+  TRACE_SEND = 1,
+  TRACE_RECV,
+  TRACE_RETRANSMIT,
+  TRACE_BAD_CKSUM,
+  TRACE_DUP,
+  TRACE_OUT_OF_WINDOW,
+};
+
+struct trace_rec {
+  uint64_t time;		/* raw clock; see struct trace_header */
+  uint32_t conn;		/* connection number, 0 if not yet known */
+  uint16_t len;			/* bytes on the wire, 0xffff on error */
+  uint8_t event;		/* enum trace_event */
+  uint8_t pad;
+  uint32_t ackno;
+  uint32_t seqno;		/* garbage if len < 12 */
+};
+
+/* Times convert to CLOCK_MONOTONIC nanoseconds as
+ * mono0 + (time - clock0) * (mono1 - mono0) / (clock1 - clock0). */
+struct trace_header {
+  char magic[4];		/* "RTRC" */
+  uint32_t version;
+  uint32_t recsize;
+  uint32_t count;		/* records that follow, oldest first */
+  uint64_t clock0, mono0;	/* at trace_init */
+  uint64_t clock1, mono1;	/* at trace_dump */
+};
+
+extern struct trace_rec *trace_ring; /* NULL when tracing is off */
+void trace_init (unsigned int nrecords); /* nrecords a power of 2 */
+void trace_record (uint32_t conn, int event, const packet_t *pkt, int n);
+int trace_dump (void);		/* async-signal-safe */
+
+/* Record a protocol event on c.  Costs one test when tracing is off. */
+void conn_trace (conn_t *c, int event, const packet_t *pkt, int n);
+
+/* USDT static probes, provider "reliable", for perf and bpftrace (see
+ * the *.bt scripts).  With <sys/sdt.h> from systemtap each is a single
+ * nop until a tracer attaches; arguments are only what is already at
+ * hand.  Without the header, or with -DNO_PROBES, they are nothing.
+ * reliable.c fires, with r as the first argument of each:
+ *   create (r, window)        destroy (r)
+ *   send (r, pkt, len)        every packet, pkt in network order
+ *   recv (r, ackno, seqno, len)  checked and in host order; seqno is
+ *                             garbage for acks (len 8)
+ *   cksum_fail (r, n)         retransmit (r, seqno, len)
+ *   ack_advance (r, from, to) the send window's lower edge moves
+ *   rtt (r, sample_ns, srtt_ns, min_ns)
+ *   window_stall (r, why)     input left unread; why is enum stall
+ *   output_blocked (r, need)  conn_bufspace has less than need bytes */
+#if !defined (NO_PROBES) && defined (__has_include)
+# if __has_include (<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define HAVE_PROBES 1
+# endif
+#endif
+#if HAVE_PROBES
+# define PROBE1(name, a) DTRACE_PROBE1 (reliable, name, a)
+# define PROBE2(name, a, b) DTRACE_PROBE2 (reliable, name, a, b)
+# define PROBE3(name, a, b, c) DTRACE_PROBE3 (reliable, name, a, b, c)
+# define PROBE4(name, a, b, c, d) DTRACE_PROBE4 (reliable, name, a, b, c, d)
+#else
+# define PROBE1(name, a) ((void) 0)
+# define PROBE2(name, a, b) ((void) 0)
+# define PROBE3(name, a, b, c) ((void) 0)
+# define PROBE4(name, a, b, c, d) ((void) 0)
+#endif
+
+enum stall {
+  STALL_WINDOW,			/* send window full */
+  STALL_RATE,			/* token bucket empty */
+  STALL_MEMORY,			/* over the memory budget */
+};
+
+/* Payload logs for -l, written by a background thread (alog.c).
+ * alog_write copies and returns; it stalls for at most a millisecond
+ * when the disk is behind and counts the bytes it then has to drop.
+ * direct asks for O_DIRECT, falling back to buffered I/O if the file
+ * system refuses it. */
+struct alog;
+struct alog *alog_open (const char *name, int direct);
+void alog_write (struct alog *, const void *buf, size_t n);
+void alog_flush (struct alog *);	/* push out a partial buffer */
+int alog_pending (const struct alog *);	/* non-zero if flush would */
+uint64_t alog_dropped (const struct alog *);
+void alog_close (struct alog *);	/* flush, then wait for the writer */
+
+/* Shared-memory rings to a peer on the same host for --shm
+ * (shmlink.c).  shmlink_open returns NULL if the link cannot be set
+ * up; until the peer has arrived (shmlink_active) and whenever the
+ * ring is full, shmlink_send returns -1 and packets should go over
+ * UDP instead.  shmlink_fd is the descriptor to poll for input. */
+struct shmlink;
+struct shmlink *shmlink_open (unsigned lport, unsigned rport);
+int shmlink_fd (const struct shmlink *);
+int shmlink_active (const struct shmlink *);
+int shmlink_accept (struct shmlink *); /* when fd readable, not active */
+int shmlink_send (struct shmlink *, const packet_t *pkt, size_t len);
+packet_t *shmlink_peek (struct shmlink *, size_t *len);
+void shmlink_pop (struct shmlink *);
+int shmlink_sleep (struct shmlink *);	/* non-zero: input is waiting */
+void shmlink_wake (struct shmlink *, int readable);
+void shmlink_close (struct shmlink *);
+
+/* Current time in nanoseconds on the library's monotonic clock.  Use
+ * this rather than calling clock_gettime directly: under relsim it
+ * returns simulated time, so timers and RTT samples stay consistent
+ * with the virtual network. */
+uint64_t conn_now (void);
+/* When the packet now in rel_recvpkt or rel_demux arrived, on the same
+ * clock.  rlib takes it from the kernel (SO_TIMESTAMPNS) where it can,
+ * so RTT samples leave out time spent queued in the socket and the
+ * event loop; otherwise, and outside a receive, it is conn_now (). */
+uint64_t conn_rxtime (conn_t *);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -264,11 +431,125 @@ void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 void rel_demux (const struct config_common *cc,
 		const struct sockaddr_storage *client,
 		packet_t *pkt, size_t len);
+/* A buffer to receive the next datagram into.  If it is then passed to
+ * rel_recvpkt or rel_demux and accepted, the receive window keeps the
+ * buffer itself rather than a copy; the next call returns a fresh one.
+ * Otherwise the same buffer comes back. */
+packet_t *rel_rxbuf (void);
+/* For a receive path with buffers of its own: rel_rxgive (pkt) before
+ * passing pkt in has the window keep pkt just the same; rel_rxtake ()
+ * afterwards returns pkt, or a fresh buffer to use in its place if the
+ * window kept it. */
+void rel_rxgive (packet_t *);
+packet_t *rel_rxtake (void);
 
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (void); /* Invoked once rel_deadline () has passed */
+/* Earliest conn_now () time at which rel_timer has work, 0 if none */
+uint64_t rel_deadline (void);
+
+/* Per-connection protocol counters.  reliable.c bumps these with plain
+ * increments on its hot paths; rel_getstats copies them out and fills
+ * in the gauges (the fields below rtt_max_ns) for reporting. */
+struct rel_stats {
+  uint64_t data_sent;		/* new data packets */
+  uint64_t retransmits;		/* data packets sent again on timeout */
+  uint64_t timeouts;		/* retransmission timer expiries */
+  uint64_t tlp_probes;		/* tail packets resent early to draw an ack */
+  uint64_t spurious_timeouts;	/* timeouts undone: the original got through */
+  uint64_t acks_sent;
+  uint64_t data_recv;
+  uint64_t acks_recv;
+  uint64_t dup_recv;		/* data already delivered or buffered */
+  uint64_t bad_cksum;
+  uint64_t bad_len;		/* truncated or impossible length */
+  uint64_t out_of_window;	/* data beyond the receive window */
+  uint64_t paws_rejected;	/* stale duplicates, by their timestamp */
+  uint64_t fec_sent;		/* parity packets */
+  uint64_t fec_recv;
+  uint64_t fec_recovered;	/* data packets rebuilt from parity */
+  uint64_t throttle_ns;		/* new data held back by the rate limit */
+  uint64_t idle_reclaims;	/* times buffers were freed while idle */
+  uint64_t rtt_samples;		/* acks of never-retransmitted packets, or
+				   any new ack with a timestamp echo */
+  uint64_t srtt_ns;		/* smoothed RTT, RFC 6298 style */
+  uint64_t rtt_min_ns;
+  uint64_t rtt_max_ns;
+  uint64_t window;
+  uint64_t in_flight;		/* sent but not yet acknowledged */
+  uint64_t rcv_pending;		/* in order but not yet output */
+};
+void rel_getstats (rel_t *, struct rel_stats *);
+/* Bytes reliable.c holds for all connections, now and at most so far.
+ * Past config_common's mem_budget, windows shrink to one packet rather
+ * than packet buffers growing further; connection blocks and window
+ * slots are still allocated as needed. */
+void rel_memory (uint64_t *used, uint64_t *peak);
+/* Closed connections still in TIME_WAIT, whether as a server's record
+ * or lingering whole. */
+int rel_lingering (void);
+/* Nonzero once both ends of data have been sent and the peer's has
+ * been output, so that r waits only for acknowledgments.  An ICMP error
+ * then means the peer has closed, not failed. */
+int rel_closing (rel_t *);
+
+/* Latency histograms, log-linear in the manner of HdrHistogram: exact
+ * below HIST_SUB ns, then HIST_SUB buckets per power of two, so a
+ * quantile read back from a bucket's midpoint is within about 6%.
+ * hist_record is a few instructions.  A bucket reaching HIST_DECAY
+ * halves them all, which keeps the quantiles and ages old samples. */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_LOG2 36	/* 69 s; longer shares the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_LOG2 - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+#define HIST_DECAY (1U << 31)
+
+struct hist {
+  uint32_t count[HIST_BUCKETS];
+};
+
+void hist_record (struct hist *, uint64_t ns);
+void hist_add (struct hist *into, const struct hist *from);
+/* Value at quantile q (0.5 for the median) of n histograms taken
+ * together, or 0 if they are empty. */
+uint64_t hist_quantile (const struct hist *const *h, int n, double q);
+
+/* What each connection's histograms measure:
+ *   LAT_RTT      every RTT sample, as folded into srtt_ns;
+ *   LAT_QUEUE    per new data packet, how long input had been left
+ *                unread at the head of the line for want of window,
+ *                rate or memory (0 if it was read at once);
+ *   LAT_DELIVER  per data packet, arrival (conn_rxtime) to the
+ *                conn_output that took it: time in the socket buffer
+ *                and event loop, reordering and head-of-line waits,
+ *                and time output was blocked.
+ * rel_latency returns a connection's LAT_NUM histograms, or NULL
+ * before its first sample; rel_latency_total sums those of every
+ * connection there has been. */
+enum lat_kind {
+  LAT_RTT,
+  LAT_QUEUE,
+  LAT_DELIVER,
+  LAT_NUM
+};
+extern const char *const lat_names[LAT_NUM];	/* "rtt", ... */
+const struct hist *rel_latency (rel_t *);
+void rel_latency_total (struct hist total[LAT_NUM]);
+
+/* Connection arena (reliable.c).  A conn_t and its rel_t share one
+ * cache-line-aligned block, conn_t first, so a connection is a single
+ * allocation.  Conn layers take every conn_t from conn_arena_alloc,
+ * except that conn_create uses the block rel_conn_block gives for the
+ * rel_t it is passed, and release it with conn_arena_free once
+ * rel_destroy has run.  Set conn_arena_hugepages before the first
+ * allocation to back the arena with huge pages. */
+extern const size_t conn_size;	/* sizeof (conn_t), from the conn layer */
+extern int conn_arena_hugepages;
+conn_t *conn_arena_alloc (void);	/* zeroed */
+conn_t *rel_conn_block (rel_t *);
+void conn_arena_free (conn_t *);
 
 
 
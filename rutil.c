@@ -0,0 +1,351 @@
+/* Helpers shared by every program built on rlib.h: the real event
+ * loop in rlib.c as well as the simulator and benchmarks, which
+ * supply their own conn_t layer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "rlib.h"
+
+char *progname;
+int opt_debug;
+
+#if !DMALLOC
+void *
+xmalloc (size_t n)
+{
+  void *p = malloc (n);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	     progname, (int) n);
+    abort ();
+  }
+  return p;
+}
+#endif /* !DMALLOC */
+
+#if NEED_CLOCK_GETTIME
+int
+clock_gettime (int id, struct timespec *tp)
+{
+  struct timeval tv;
+
+  switch (id) {
+  case CLOCK_REALTIME:
+  case CLOCK_MONOTONIC:		/* XXX */
+    if (gettimeofday (&tv, NULL) < 0)
+      return -1;
+    tp->tv_sec = tv.tv_sec;
+    tp->tv_nsec = tv.tv_usec * 1000;
+    return 0;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+}
+#endif /* NEED_CLOCK_GETTIME */
+
+void
+print_pkt (const packet_t *buf, const char *op, int n)
+{
+  static int pid = -1;
+  int saved_errno = errno;
+  if (pid == -1)
+    pid = getpid ();
+  if (n < 0) {
+    if (errno != EAGAIN)
+      fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
+  }
+  else if (n == 8)
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno));
+  else if (n >= 12)
+    fprintf (stderr,
+	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
+	     ntohl (buf->seqno));
+  else
+    fprintf (stderr, "%5d %s(%3d):\n", pid, op, n);
+  errno = saved_errno;
+}
+
+uint16_t
+cksum (const void *_data, int len)
+{
+  const uint8_t *data = _data;
+  uint32_t sum;
+
+  for (sum = 0;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+int
+addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family)
+    return 0;
+  switch (a->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *aa = (const struct sockaddr_in *) a;
+      const struct sockaddr_in *bb = (const struct sockaddr_in *) b;
+      return (aa->sin_addr.s_addr == bb->sin_addr.s_addr
+	      && aa->sin_port == bb->sin_port);
+    }
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *aa = (const struct sockaddr_in6 *) a;
+      const struct sockaddr_in6 *bb = (const struct sockaddr_in6 *) b;
+      return (!memcmp (&aa->sin6_addr, &bb->sin6_addr, sizeof (aa->sin6_addr))
+	      && aa->sin6_port == bb->sin6_port);
+    }
+  case AF_UNIX:
+    {
+      const struct sockaddr_un *aa = (const struct sockaddr_un *) a;
+      const struct sockaddr_un *bb = (const struct sockaddr_un *) b;
+      return !strcmp (aa->sun_path, bb->sun_path);
+    }
+  }
+  fprintf (stderr, "addrhash: unknown address family %d\n",
+	   a->ss_family);
+  abort ();
+}
+
+size_t
+addrsize (const struct sockaddr_storage *ss)
+{
+  switch (ss->ss_family) {
+  case AF_INET:
+    return sizeof (struct sockaddr_in);
+  case AF_INET6:
+    return sizeof (struct sockaddr_in6);
+  case AF_UNIX:
+    return sizeof (struct sockaddr_un);
+  }
+  fprintf (stderr, "addrsize: unknown address family %d\n",
+	   ss->ss_family);
+  abort ();
+}
+
+static inline unsigned int
+hash_bytes (const void *_key, int len, unsigned int seed)
+{
+  const unsigned char *key = (const unsigned char *) _key;
+  const unsigned char *end;
+
+  for (end = key + len; key < end; key++)
+    seed = ((seed << 5) + seed) ^ *key;
+  return seed;
+}
+unsigned int
+addrhash (const struct sockaddr_storage *ss)
+{
+  unsigned int r = 5381;
+  switch (ss->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *s = (const struct sockaddr_in *) ss;
+      r = hash_bytes (&s->sin_port, 2, r);
+      return hash_bytes (&s->sin_addr, 4, r);
+    }
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *s = (const struct sockaddr_in6 *) ss;
+      r = hash_bytes (&s->sin6_port, 2, r);
+      return hash_bytes (&s->sin6_addr, 16, r);
+    }
+  case AF_UNIX:
+    {
+      const struct sockaddr_un *s = (const struct sockaddr_un *) ss;
+      return hash_bytes (s->sun_path, strlen (s->sun_path), r);
+    }
+  }
+  fprintf (stderr, "addrhash: unknown address family %d\n",
+	   ss->ss_family);
+  abort ();
+}
+
+struct trace_rec *trace_ring;
+static uint32_t trace_mask;
+static uint32_t trace_head;
+static uint64_t trace_clock0, trace_mono0;
+static char trace_name[32];
+
+/* The TSC where there is one: a few cycles, against tens of
+ * nanoseconds for clock_gettime.  trace_dump records both clocks so
+ * tracedump can convert. */
+static inline uint64_t
+trace_clock (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+  return __builtin_ia32_rdtsc ();
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t
+trace_mono (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+trace_init (unsigned int nrecords)
+{
+  assert (nrecords && !(nrecords & (nrecords - 1)));
+  trace_ring = xmalloc (nrecords * sizeof (*trace_ring));
+  memset (trace_ring, 0, nrecords * sizeof (*trace_ring));
+  trace_mask = nrecords - 1;
+  trace_head = 0;
+  snprintf (trace_name, sizeof (trace_name), "%d.trace", (int) getpid ());
+  trace_mono0 = trace_mono ();
+  trace_clock0 = trace_clock ();
+}
+
+void
+trace_record (uint32_t conn, int event, const packet_t *pkt, int n)
+{
+  struct trace_rec *r = &trace_ring[trace_head++ & trace_mask];
+
+  r->time = trace_clock ();
+  r->conn = conn;
+  r->len = n < 0 ? 0xffff : n;
+  r->event = event;
+  r->ackno = pkt->ackno;
+  r->seqno = pkt->seqno;
+}
+
+/* Only uses async-signal-safe calls, so signal handlers may call it.
+ * Records being written when a signal lands may come out torn. */
+int
+trace_dump (void)
+{
+  struct trace_header h;
+  uint32_t head = trace_head, size = trace_mask + 1, first;
+  int fd, ok;
+
+  if (!trace_ring)
+    return 0;
+  memcpy (h.magic, "RTRC", 4);
+  h.version = 1;
+  h.recsize = sizeof (struct trace_rec);
+  h.count = head < size ? head : size;
+  h.clock0 = trace_clock0;
+  h.mono0 = trace_mono0;
+  h.clock1 = trace_clock ();
+  h.mono1 = trace_mono ();
+
+  fd = open (trace_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+  first = head - h.count;
+  ok = write (fd, &h, sizeof (h)) == sizeof (h);
+  if ((first & trace_mask) + h.count <= size)
+    ok = ok && write (fd, &trace_ring[first & trace_mask],
+		      h.count * sizeof (*trace_ring)) >= 0;
+  else {
+    uint32_t tail = size - (first & trace_mask);
+    ok = ok && write (fd, &trace_ring[first & trace_mask],
+		      tail * sizeof (*trace_ring)) >= 0
+      && write (fd, trace_ring, (h.count - tail) * sizeof (*trace_ring)) >= 0;
+  }
+  close (fd);
+  return ok ? 0 : -1;
+}
+
+const char *const lat_names[LAT_NUM] = {
+  [LAT_RTT] = "rtt",
+  [LAT_QUEUE] = "queue",
+  [LAT_DELIVER] = "deliver",
+};
+
+/* Halving rounds up, so a bucket holding a single tail sample keeps it
+ * and the high quantiles survive a decay. */
+static void
+hist_decay (struct hist *h)
+{
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    h->count[i] = (h->count[i] + 1) >> 1;
+}
+
+void
+hist_record (struct hist *h, uint64_t ns)
+{
+  unsigned i = ns;
+
+  if (ns >= HIST_SUB) {
+    int e = 63 - __builtin_clzll (ns);
+    i = e > HIST_MAX_LOG2 ? HIST_BUCKETS - 1
+      : (unsigned) (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS
+      | (ns >> (e - HIST_SUB_BITS) & (HIST_SUB - 1));
+  }
+  if (++h->count[i] == HIST_DECAY)
+    hist_decay (h);
+}
+
+void
+hist_add (struct hist *into, const struct hist *from)
+{
+  uint64_t max = 0;
+  int i, shift = 0;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if ((uint64_t) into->count[i] + from->count[i] > max)
+      max = (uint64_t) into->count[i] + from->count[i];
+  /* Scaled down like hist_decay, rounding up */
+  while ((max + ((1ULL << shift) - 1)) >> shift >= HIST_DECAY)
+    shift++;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    into->count[i] = ((uint64_t) into->count[i] + from->count[i]
+		      + ((1ULL << shift) - 1)) >> shift;
+}
+
+uint64_t
+hist_quantile (const struct hist *const *h, int n, double q)
+{
+  uint64_t total = 0, seen = 0, target, sum[HIST_BUCKETS];
+  int i, j, e;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    sum[i] = 0;
+    for (j = 0; j < n; j++)
+      sum[i] += h[j]->count[i];
+    total += sum[i];
+  }
+  if (!total)
+    return 0;
+  target = q * total;
+  if (target >= total)
+    target = total - 1;
+  for (i = 0; seen + sum[i] <= target; i++)
+    seen += sum[i];
+  if (i < HIST_SUB)
+    return i;
+  /* Bucket i covers HIST_SUB + sub shifted left by e - HIST_SUB_BITS,
+   * one unit of that shift wide; report its midpoint. */
+  e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  return ((uint64_t) (HIST_SUB + (i & (HIST_SUB - 1))) << (e - HIST_SUB_BITS))
+    + ((uint64_t) 1 << (e - HIST_SUB_BITS) >> 1);
+}
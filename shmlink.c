@@ -0,0 +1,375 @@
+/* Shared-memory packet path to a peer on the same host (--shm).
+ *
+ * The two processes share a memfd holding one single-producer/
+ * single-consumer ring per direction.  A packet is copied into the
+ * next slot and the head published; the receiver hands the slot to
+ * rel_recvpkt in place and then advances the tail.  Neither side makes
+ * a system call per packet: a consumer about to sleep sets its ring's
+ * waiting flag, and only then does the producer write to the eventfd
+ * the consumer polls.
+ *
+ * The peers meet on an abstract unix socket named after the two UDP
+ * ports.  Whoever binds it first creates the memfd and eventfds and
+ * passes them to the other with SCM_RIGHTS when it connects.  Anyone
+ * on the host can reach that name, so each side checks the other's
+ * credentials and refuses a peer running as a different user.  Until
+ * then, and whenever a ring is full, packets simply go over UDP. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "rlib.h"
+
+#define SHM_SLOTS 4096		/* power of 2, per direction */
+#define SHM_MAGIC 0x52534d31	/* "RSM1" */
+#define SHM_TIMEOUT_MS 1000	/* joiner's wait for the creator's fds */
+
+struct shm_slot {
+  uint32_t len;
+  packet_t pkt;
+} __attribute__ ((aligned (64)));
+
+struct shm_ring {
+  _Atomic uint32_t head __attribute__ ((aligned (64)));	/* producer's */
+  _Atomic uint32_t tail __attribute__ ((aligned (64)));	/* consumer's */
+  _Atomic uint32_t waiting;	/* consumer is (about to be) in poll */
+  struct shm_slot slots[SHM_SLOTS];
+};
+
+/* rings[0] carries creator to joiner. */
+struct shm_segment {
+  uint32_t magic;
+  struct shm_ring rings[2];
+};
+
+struct shmlink {
+  int sock;			/* listening, until the peer arrives */
+  int memfd;			/* creator's, until handed over */
+  int efd[2];			/* [0] ours to poll, [1] the peer's */
+  struct shm_segment *seg;
+  struct shm_ring *tx, *rx;
+};
+
+static void
+shmlink_name (struct sockaddr_un *sun, unsigned lport, unsigned rport)
+{
+  memset (sun, 0, sizeof (*sun));
+  sun->sun_family = AF_UNIX;
+  snprintf (sun->sun_path + 1, sizeof (sun->sun_path) - 1,
+	    "reliable-shm-%u-%u", lport < rport ? lport : rport,
+	    lport < rport ? rport : lport);
+}
+
+static socklen_t
+shmlink_namelen (const struct sockaddr_un *sun)
+{
+  return offsetof (struct sockaddr_un, sun_path)
+    + 1 + strlen (sun->sun_path + 1);
+}
+
+static int
+shmlink_map (struct shmlink *l, int memfd, int creator)
+{
+  l->seg = mmap (NULL, sizeof (*l->seg), PROT_READ | PROT_WRITE,
+		 MAP_SHARED, memfd, 0);
+  if (l->seg == MAP_FAILED) {
+    perror ("shm mmap");
+    l->seg = NULL;
+    return -1;
+  }
+  if (!creator && l->seg->magic != SHM_MAGIC) {
+    fprintf (stderr, "%s: bad shared memory segment\n", progname);
+    return -1;
+  }
+  l->tx = &l->seg->rings[!creator];
+  l->rx = &l->seg->rings[creator];
+  return 0;
+}
+
+/* Returns 1 if the process at the other end of unix socket s runs
+ * as our user. */
+static int
+shmlink_peer_ok (int s)
+{
+  struct ucred cr;
+  socklen_t len = sizeof (cr);
+
+  if (getsockopt (s, SOL_SOCKET, SO_PEERCRED, &cr, &len) < 0) {
+    perror ("shm SO_PEERCRED");
+    return 0;
+  }
+  if (cr.uid != geteuid ()) {
+    fprintf (stderr, "%s: refusing shared memory peer with uid %u\n",
+	     progname, (unsigned) cr.uid);
+    return 0;
+  }
+  return 1;
+}
+
+/* Creator side: builds the segment and waits for the peer on sock. */
+static int
+shmlink_create (struct shmlink *l)
+{
+  int memfd;
+
+  if ((memfd = memfd_create ("reliable-shm", MFD_CLOEXEC)) < 0
+      || ftruncate (memfd, sizeof (*l->seg)) < 0) {
+    perror ("memfd_create");
+    if (memfd >= 0)
+      close (memfd);
+    return -1;
+  }
+  l->memfd = memfd;
+  if (listen (l->sock, 1) < 0) {
+    perror ("shm listen");
+    return -1;
+  }
+  if ((l->efd[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+      || (l->efd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror ("eventfd");
+    return -1;
+  }
+  make_async (l->sock);
+  if (shmlink_map (l, memfd, 1) < 0)
+    return -1;
+  l->seg->magic = SHM_MAGIC;
+  return 0;
+}
+
+/* Joiner side: receives the memfd and eventfds over the socket. */
+static int
+shmlink_join (struct shmlink *l)
+{
+  int fds[3];
+  char cbuf[CMSG_SPACE (sizeof (fds))], b;
+  struct iovec iov = { &b, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct timeval tv = { SHM_TIMEOUT_MS / 1000, SHM_TIMEOUT_MS % 1000 * 1000 };
+
+  if (!shmlink_peer_ok (l->sock))
+    return -1;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof (cbuf);
+  setsockopt (l->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  if (recvmsg (l->sock, &msg, MSG_CMSG_CLOEXEC) <= 0
+      || !(cm = CMSG_FIRSTHDR (&msg)) || cm->cmsg_type != SCM_RIGHTS
+      || cm->cmsg_len != CMSG_LEN (sizeof (fds))) {
+    fprintf (stderr, "%s: no reply from shared memory peer\n", progname);
+    return -1;
+  }
+  memcpy (fds, CMSG_DATA (cm), sizeof (fds));
+  /* The creator polls the first eventfd and wakes us with the second. */
+  l->efd[0] = fds[2];
+  l->efd[1] = fds[1];
+  close (l->sock);
+  l->sock = -1;
+  l->memfd = fds[0];
+  if (shmlink_map (l, fds[0], 0) < 0)
+    return -1;
+  close (l->memfd);
+  l->memfd = -1;
+  return 0;
+}
+
+struct shmlink *
+shmlink_open (unsigned lport, unsigned rport)
+{
+  struct shmlink *l = xmalloc (sizeof (*l));
+  struct sockaddr_un sun;
+  int tries;
+
+  memset (l, 0, sizeof (*l));
+  l->memfd = l->efd[0] = l->efd[1] = -1;
+  shmlink_name (&sun, lport, rport);
+
+  /* Connect if the peer is already there, else bind and wait for it.
+   * If both start at once, the loser of the bind connects again. */
+  for (tries = 0; tries < 10; tries++) {
+    if ((l->sock = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+      perror ("shm socket");
+      break;
+    }
+    if (connect (l->sock, (struct sockaddr *) &sun,
+		 shmlink_namelen (&sun)) == 0) {
+      if (shmlink_join (l) == 0)
+	return l;
+      break;
+    }
+    if (bind (l->sock, (struct sockaddr *) &sun, shmlink_namelen (&sun)) == 0) {
+      if (shmlink_create (l) == 0)
+	return l;
+      break;
+    }
+    close (l->sock);
+    l->sock = -1;
+    usleep (1000);
+  }
+  shmlink_close (l);
+  return NULL;
+}
+
+int
+shmlink_fd (const struct shmlink *l)
+{
+  return l->sock >= 0 ? l->sock : l->efd[0];
+}
+
+int
+shmlink_active (const struct shmlink *l)
+{
+  return l->sock < 0;
+}
+
+/* Called when the listening socket is readable: hands the peer the
+ * segment and eventfds.  Returns 1 once the link is up. */
+int
+shmlink_accept (struct shmlink *l)
+{
+  int fds[3], s;
+  char cbuf[CMSG_SPACE (sizeof (fds))], b = 0;
+  struct iovec iov = { &b, 1 };
+  struct msghdr msg;
+  struct cmsghdr *cm;
+
+  if ((s = accept4 (l->sock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+    return 0;
+  if (!shmlink_peer_ok (s)) {
+    close (s);
+    return 0;
+  }
+  fds[0] = l->memfd;
+  fds[1] = l->efd[0];
+  fds[2] = l->efd[1];
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof (cbuf);
+  cm = CMSG_FIRSTHDR (&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cm), fds, sizeof (fds));
+  if (sendmsg (s, &msg, MSG_NOSIGNAL) < 0) {
+    perror ("shm sendmsg");
+    close (s);
+    return 0;
+  }
+  close (s);
+  close (l->memfd);
+  l->memfd = -1;
+  close (l->sock);
+  l->sock = -1;
+  return 1;
+}
+
+/* Returns 0 if pkt went into the ring, -1 if it is full (or the peer
+ * has not arrived yet) and the caller should use UDP. */
+int
+shmlink_send (struct shmlink *l, const packet_t *pkt, size_t len)
+{
+  struct shm_ring *r = l->tx;
+  uint32_t head;
+  struct shm_slot *s;
+
+  if (l->sock >= 0)
+    return -1;
+  head = atomic_load_explicit (&r->head, memory_order_relaxed);
+  if (head - atomic_load_explicit (&r->tail, memory_order_acquire)
+      >= SHM_SLOTS)
+    return -1;
+  s = &r->slots[head % SHM_SLOTS];
+  s->len = len;
+  memcpy (&s->pkt, pkt, len);
+  /* seq_cst pairs with shmlink_sleep: either the consumer sees the new
+   * head or we see its waiting flag. */
+  atomic_store (&r->head, head + 1);
+  if (atomic_load (&r->waiting) && atomic_exchange (&r->waiting, 0)) {
+    uint64_t one = 1;
+    if (write (l->efd[1], &one, sizeof (one)) < 0 && errno != EAGAIN)
+      perror ("eventfd write");
+  }
+  return 0;
+}
+
+/* Returns the oldest unread packet, which stays valid (and may be
+ * modified) until shmlink_pop, or NULL if the ring is empty. */
+packet_t *
+shmlink_peek (struct shmlink *l, size_t *len)
+{
+  struct shm_ring *r = l->rx;
+  uint32_t tail = atomic_load_explicit (&r->tail, memory_order_relaxed);
+  struct shm_slot *s;
+
+  if (tail == atomic_load_explicit (&r->head, memory_order_acquire))
+    return NULL;
+  s = &r->slots[tail % SHM_SLOTS];
+  *len = s->len < sizeof (s->pkt) ? s->len : sizeof (s->pkt);
+  return &s->pkt;
+}
+
+void
+shmlink_pop (struct shmlink *l)
+{
+  struct shm_ring *r = l->rx;
+  atomic_store_explicit (&r->tail,
+			 atomic_load_explicit (&r->tail, memory_order_relaxed)
+			 + 1, memory_order_release);
+}
+
+/* Called before poll.  Asks the peer for a wakeup on the next packet
+ * and returns non-zero if one is already waiting, in which case the
+ * caller must not block. */
+int
+shmlink_sleep (struct shmlink *l)
+{
+  struct shm_ring *r = l->rx;
+
+  if (l->sock >= 0)
+    return 0;
+  atomic_store (&r->waiting, 1);
+  return atomic_load (&r->head) != atomic_load (&r->tail);
+}
+
+/* Called after poll: cancels the wakeup and clears the eventfd. */
+void
+shmlink_wake (struct shmlink *l, int readable)
+{
+  uint64_t n;
+
+  atomic_store_explicit (&l->rx->waiting, 0, memory_order_relaxed);
+  if (readable && read (l->efd[0], &n, sizeof (n)) < 0 && errno != EAGAIN)
+    perror ("eventfd read");
+}
+
+void
+shmlink_close (struct shmlink *l)
+{
+  if (l->sock >= 0)
+    close (l->sock);
+  if (l->memfd >= 0)
+    close (l->memfd);
+  if (l->efd[0] >= 0)
+    close (l->efd[0]);
+  if (l->efd[1] >= 0)
+    close (l->efd[1]);
+  if (l->seg)
+    munmap (l->seg, sizeof (*l->seg));
+  free (l);
+}
@@ -0,0 +1,560 @@
+/* Discrete-event driver for reliable.c.
+ *
+ * relsim links the protocol against a simulated conn_t layer in place
+ * of rlib.c.  conn_poll and clock_gettime are replaced by a virtual
+ * clock that jumps straight to the next packet arrival or
+ * rel_deadline, so long transfers over many connections finish in a
+ * fraction of their simulated time and are exactly reproducible from
+ * the seed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+struct conn {
+  rel_t *rel;
+  struct conn *peer;		/* other end of the simulated link */
+  int id;
+
+  uint64_t in_total;		/* bytes the application will write */
+  uint64_t in_read;		/* bytes handed to conn_input so far */
+  uint64_t out_recv;		/* bytes delivered through conn_output */
+  uint64_t out_bad;		/* delivered bytes that did not match */
+  uint64_t done_at;		/* virtual time the last byte arrived */
+
+  char read_eof;
+  char write_eof;
+  char xoff;			/* waiting for conn_input, as in rlib.c */
+  char runnable;		/* queued to get rel_read */
+  char delete_me;
+
+  uint64_t link_busy;		/* outbound link transmitting until then */
+  struct conn *nextrun;
+};
+
+const size_t conn_size = sizeof (conn_t);
+
+struct event {
+  uint64_t at;
+  uint64_t order;		/* tie-break so runs are deterministic */
+  conn_t *dst;
+  size_t len;
+  packet_t pkt;
+};
+
+struct sim_config {
+  int pairs;
+  uint64_t bytes;		/* per direction, per connection */
+  uint64_t duration;		/* give up after this much virtual time */
+  uint64_t delay;		/* one-way propagation delay */
+  uint64_t jitter;		/* extra uniformly random delay */
+  uint64_t queue;		/* max queueing delay before tail drop */
+  double bandwidth;		/* bits per second, per direction */
+  double loss;			/* independent drop probability */
+  uint64_t seed;
+};
+
+static struct sim_config sc;
+static uint64_t now;
+static uint64_t rng_state;
+
+/* Pending events, a min-heap on (at, order).  The keys are copied into
+ * the heap so that sifting does not touch the events themselves. */
+struct heap_entry {
+  uint64_t at, order;
+  struct event *e;
+};
+
+static struct heap_entry *heap;
+static size_t nheap, heapsize;
+static uint64_t event_order;
+
+static conn_t *runq;
+static conn_t **runqtail = &runq;
+
+static uint64_t pkts_sent, pkts_dropped, bytes_sent;
+static int streams_done;
+
+static uint64_t
+rng (void)
+{
+  /* xorshift64* */
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double
+rng_unit (void)
+{
+  return (rng () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Word off/8 of connection id's input stream.  Both ends can compute
+ * it, which is how conn_output checks delivery. */
+static uint64_t
+stream_word (int id, uint64_t off)
+{
+  uint64_t x = (off >> 3) ^ ((uint64_t) id << 40) ^ sc.seed;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static void
+stream_fill (int id, uint64_t off, uint8_t *buf, size_t n)
+{
+  while (n > 0) {
+    uint64_t w = stream_word (id, off);
+    size_t skip = off & 7, k = 8 - skip;
+    if (k == 8 && n >= 8)
+      memcpy (buf, &w, 8);	/* the usual case, as one store */
+    else {
+      if (k > n)
+	k = n;
+      memcpy (buf, (uint8_t *) &w + skip, k);
+    }
+    buf += k;
+    off += k;
+    n -= k;
+  }
+}
+
+static int
+event_before (const struct heap_entry *a, const struct heap_entry *b)
+{
+  return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static void
+heap_push (struct event *e)
+{
+  struct heap_entry he = { e->at, e->order, e };
+  size_t i;
+
+  if (nheap == heapsize) {
+    heapsize = heapsize ? 2 * heapsize : 1024;
+    heap = realloc (heap, heapsize * sizeof (*heap));
+    if (!heap) {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      abort ();
+    }
+  }
+  for (i = nheap++; i > 0 && event_before (&he, &heap[(i - 1) / 2]);
+       i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = he;
+}
+
+static struct event *
+heap_pop (void)
+{
+  struct event *top = heap[0].e;
+  struct heap_entry last = heap[--nheap];
+  size_t i = 0, child;
+
+  while ((child = 2 * i + 1) < nheap) {
+    if (child + 1 < nheap && event_before (&heap[child + 1], &heap[child]))
+      child++;
+    if (!event_before (&heap[child], &last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+static void
+make_runnable (conn_t *c)
+{
+  if (c->runnable || c->delete_me)
+    return;
+  c->runnable = 1;
+  c->nextrun = NULL;
+  *runqtail = c;
+  runqtail = &c->nextrun;
+}
+
+uint64_t
+conn_now (void)
+{
+  return now;
+}
+
+uint64_t
+conn_rxtime (conn_t *c)
+{
+  return now;
+}
+
+conn_t *
+conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+{
+  /* Every simulated connection is set up by main. */
+  return NULL;
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  struct event *e;
+  uint64_t start, tx;
+
+  assert (!c->delete_me);
+  pkts_sent++;
+  bytes_sent += len;
+  if (opt_debug)
+    print_pkt (pkt, "send", len);
+
+  if (sc.loss > 0 && rng_unit () < sc.loss) {
+    pkts_dropped++;
+    return len;
+  }
+
+  start = c->link_busy > now ? c->link_busy : now;
+  if (sc.queue && start - now > sc.queue) {
+    pkts_dropped++;
+    return len;
+  }
+  tx = (uint64_t) (len * 8 * 1e9 / sc.bandwidth);
+  c->link_busy = start + tx;
+
+  e = xmalloc (sizeof (*e));
+  e->at = c->link_busy + sc.delay;
+  if (sc.jitter)
+    e->at += rng () % sc.jitter;
+  e->order = event_order++;
+  e->dst = c->peer;
+  e->len = len;
+  memcpy (&e->pkt, pkt, len);
+  heap_push (e);
+  return len;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  /* The simulated application drains output as soon as it arrives. */
+  return 8192;
+}
+
+int
+conn_output (conn_t *c, const void *_buf, size_t n)
+{
+  const uint8_t *buf = _buf;
+  uint8_t expect[sizeof (((packet_t *) 0)->data)];
+  size_t i, done, chunk;
+
+  assert (!c->delete_me && !c->write_eof);
+  if (n == 0) {
+    c->write_eof = 1;
+    return 0;
+  }
+  for (done = 0; done < n; done += chunk) {
+    chunk = n - done < sizeof (expect) ? n - done : sizeof (expect);
+    stream_fill (c->peer->id, c->out_recv + done, expect, chunk);
+    if (memcmp (buf + done, expect, chunk))
+      for (i = 0; i < chunk; i++)
+	c->out_bad += buf[done + i] != expect[i];
+  }
+  c->out_recv += n;
+  if (c->out_recv == c->peer->in_total) {
+    c->done_at = now;
+    streams_done++;
+  }
+  return n;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t n)
+{
+  assert (!c->delete_me);
+  if (c->read_eof)
+    return -1;
+  if (c->in_read == c->in_total) {
+    c->read_eof = 1;
+    return -1;
+  }
+  if (n > c->in_total - c->in_read)
+    n = c->in_total - c->in_read;
+  stream_fill (c->id, c->in_read, buf, n);
+  c->in_read += n;
+
+  c->xoff = 0;
+  make_runnable (c);
+  return n;
+}
+
+int
+conn_sendto (const struct sockaddr_storage *ss,
+	     const packet_t *pkt, size_t len)
+{
+  return -1;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  c->delete_me = 1;
+}
+
+void
+conn_trace (conn_t *c, int event, const packet_t *pkt, int n)
+{
+  if (trace_ring)
+    trace_record (c->id, event, pkt, n);
+}
+
+/* Stand-in for conn_poll: give every connection with pending input a
+ * rel_read, then advance the clock to the next arrival or timer
+ * deadline and process it.  Returns 0 once neither is left. */
+static int
+sim_step (void)
+{
+  conn_t *c;
+  struct event *e;
+  uint64_t deadline;
+
+  while ((c = runq)) {
+    runq = c->nextrun;
+    if (!runq)
+      runqtail = &runq;
+    c->runnable = 0;
+    if (c->delete_me || c->xoff || c->read_eof)
+      continue;
+    c->xoff = 1;
+    rel_read (c->rel);
+  }
+
+  deadline = rel_deadline ();
+  if (!nheap && !deadline)
+    return 0;
+  if (!nheap || (deadline && deadline <= heap[0].at)) {
+    if (deadline > now)
+      now = deadline;
+    rel_timer ();
+    return 1;
+  }
+
+  e = heap_pop ();
+  now = e->at;
+  if (!e->dst->delete_me)
+    rel_recvpkt (e->dst->rel, &e->pkt, e->len);
+  free (e);
+  return 1;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: %s [-n pairs] [-w window] [-t timeout-ms] [-B bytes]\n"
+	   "       %*s [-T seconds] [-d delay-ms] [-j jitter-ms] [-q queue-ms]\n"
+	   "       %*s [-b Mbit/s] [-l loss] [-s seed] [-F group] [-D]\n"
+	   "       %*s [-r rate-Mbit/s] [-R burst-bytes] [-M mem-budget] [-E]\n"
+	   "       %*s [-x max-retransmits-per-drop]\n",
+	   progname, (int) strlen (progname), "", (int) strlen (progname), "",
+	   (int) strlen (progname), "", (int) strlen (progname), "");
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct config_common cc;
+  conn_t **conns;
+  struct timespec wall0, wall1;
+  uint64_t delivered = 0, bad = 0, last_done = 0;
+  uint64_t rexmit = 0, dups = 0, srtt_sum = 0;
+  uint64_t fec_sent = 0, fec_rebuilt = 0, throttled = 0, mem, mem_peak;
+  uint64_t timeouts = 0, probes = 0, spurious = 0;
+  struct rel_stats rs;
+  struct hist lat[LAT_NUM];
+  int opt, i, n, incomplete = 0, wasteful = 0;
+  double wall, simtime, max_rexmit = 0;
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  memset (&cc, 0, sizeof (cc));
+  cc.window = 1;
+  cc.timeout = 2000;
+
+  sc.pairs = 1;
+  sc.bytes = 1 << 20;
+  sc.duration = 60 * 1000000000ULL;
+  sc.delay = 10 * 1000000ULL;
+  sc.bandwidth = 10e9;
+  sc.seed = 1;
+
+  while ((opt = getopt (argc, argv, "n:w:t:B:T:d:j:q:b:l:s:DF:r:R:M:Ex:")) != -1)
+    switch (opt) {
+    case 'n':
+      sc.pairs = atoi (optarg);
+      break;
+    case 'w':
+      cc.window = atoi (optarg);
+      break;
+    case 't':
+      cc.timeout = atoi (optarg);
+      break;
+    case 'B':
+      sc.bytes = strtoull (optarg, NULL, 0);
+      break;
+    case 'T':
+      sc.duration = (uint64_t) (atof (optarg) * 1e9);
+      break;
+    case 'd':
+      sc.delay = (uint64_t) (atof (optarg) * 1e6);
+      break;
+    case 'j':
+      sc.jitter = (uint64_t) (atof (optarg) * 1e6);
+      break;
+    case 'q':
+      sc.queue = (uint64_t) (atof (optarg) * 1e6);
+      break;
+    case 'b':
+      sc.bandwidth = atof (optarg) * 1e6;
+      break;
+    case 'l':
+      sc.loss = atof (optarg);
+      break;
+    case 's':
+      sc.seed = strtoull (optarg, NULL, 0);
+      break;
+    case 'D':
+      opt_debug = 1;
+      break;
+    case 'F':
+      cc.fec = atoi (optarg);
+      break;
+    case 'r':
+      cc.rate = atof (optarg) * 1e6 / 8;
+      break;
+    case 'R':
+      cc.burst = strtoull (optarg, NULL, 0);
+      break;
+    case 'M':
+      cc.mem_budget = strtoull (optarg, NULL, 0);
+      break;
+    case 'E':
+      cc.timestamps = 1;
+      break;
+    case 'x':
+      max_rexmit = atof (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || sc.pairs < 1 || cc.window < 1 || cc.timeout < 10
+      || sc.bandwidth <= 0 || sc.loss < 0 || sc.loss >= 1
+      || cc.fec < 0 || cc.fec > 255)
+    usage ();
+  cc.timer = cc.timeout / 5;
+  rng_state = sc.seed ? sc.seed : 1;
+
+  n = 2 * sc.pairs;
+  conns = xmalloc (n * sizeof (*conns));
+  for (i = 0; i < n; i++)
+    conns[i] = conn_arena_alloc ();
+  for (i = 0; i < n; i++) {
+    conn_t *c = conns[i];
+    c->id = i;
+    c->peer = conns[i ^ 1];
+    c->in_total = sc.bytes;
+    c->rel = rel_create (c, NULL, &cc);
+    make_runnable (c);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &wall0);
+  while (now < sc.duration && streams_done < n && sim_step ())
+    ;
+  clock_gettime (CLOCK_MONOTONIC, &wall1);
+
+  for (i = 0; i < n; i++) {
+    rel_getstats (conns[i]->rel, &rs);
+    rexmit += rs.retransmits;
+    timeouts += rs.timeouts;
+    probes += rs.tlp_probes;
+    spurious += rs.spurious_timeouts;
+    dups += rs.dup_recv;
+    srtt_sum += rs.srtt_ns;
+    fec_sent += rs.fec_sent;
+    fec_rebuilt += rs.fec_recovered;
+    throttled += rs.throttle_ns;
+    delivered += conns[i]->out_recv;
+    bad += conns[i]->out_bad;
+    if (conns[i]->out_recv < conns[i]->peer->in_total)
+      incomplete++;
+    else if (conns[i]->done_at > last_done)
+      last_done = conns[i]->done_at;
+  }
+  simtime = now / 1e9;
+  wall = (wall1.tv_sec - wall0.tv_sec) + (wall1.tv_nsec - wall0.tv_nsec) / 1e9;
+
+  printf ("seed %llu: %d connections, window %d, timeout %d ms, "
+	  "loss %g, delay %g ms, %g Mbit/s\n",
+	  (unsigned long long) sc.seed, n, cc.window, cc.timeout,
+	  sc.loss, sc.delay / 1e6, sc.bandwidth / 1e6);
+  printf ("simulated %.3f s, last stream finished at %.3f s\n",
+	  simtime, last_done / 1e9);
+  printf ("delivered %llu bytes (%.2f Mbit/s goodput), "
+	  "%d streams incomplete, %llu bytes corrupt\n",
+	  (unsigned long long) delivered,
+	  last_done ? delivered * 8 / (last_done / 1e9) / 1e6 : 0.0,
+	  incomplete, (unsigned long long) bad);
+  printf ("packets sent %llu (%llu bytes), dropped %llu\n",
+	  (unsigned long long) pkts_sent, (unsigned long long) bytes_sent,
+	  (unsigned long long) pkts_dropped);
+  printf ("retransmits %llu, duplicates received %llu, mean srtt %.3f ms\n",
+	  (unsigned long long) rexmit, (unsigned long long) dups,
+	  srtt_sum / 1e6 / n);
+  printf ("timeouts %llu (%llu spurious), tail loss probes %llu\n",
+	  (unsigned long long) timeouts, (unsigned long long) spurious,
+	  (unsigned long long) probes);
+  rel_latency_total (lat);
+  printf ("latency p50/p99/p99.9 ms:");
+  for (i = 0; i < LAT_NUM; i++) {
+    const struct hist *h = &lat[i];
+    printf (" %s %.3f/%.3f/%.3f", lat_names[i],
+	    hist_quantile (&h, 1, 0.5) / 1e6, hist_quantile (&h, 1, 0.99) / 1e6,
+	    hist_quantile (&h, 1, 0.999) / 1e6);
+  }
+  printf ("\n");
+  if (cc.fec)
+    printf ("parity packets sent %llu, data packets rebuilt %llu\n",
+	    (unsigned long long) fec_sent, (unsigned long long) fec_rebuilt);
+  rel_memory (&mem, &mem_peak);
+  printf ("connection memory peak %llu bytes", (unsigned long long) mem_peak);
+  if (cc.mem_budget)
+    printf (" (budget %llu)", (unsigned long long) cc.mem_budget);
+  printf ("\n");
+  if (cc.rate)
+    printf ("rate limit %g Mbit/s, mean time throttled %.3f s\n",
+	    cc.rate * 8 / 1e6, throttled / 1e9 / n);
+  fprintf (stderr, "[%.3f s wall clock, %.1fx real time]\n",
+	   wall, wall > 0 ? simtime / wall : 0.0);
+
+  /* Loss recovery that resends much more than was lost has gone back
+   * to go-back-N somewhere. */
+  if (max_rexmit > 0 && rexmit > max_rexmit * (pkts_dropped + 1)) {
+    fprintf (stderr, "%s: %llu retransmits for %llu drops, more than %g each\n",
+	     progname, (unsigned long long) rexmit,
+	     (unsigned long long) pkts_dropped, max_rexmit);
+    wasteful = 1;
+  }
+  return incomplete || bad || wasteful ? 1 : 0;
+}
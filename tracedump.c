@@ -0,0 +1,94 @@
+/* Decoder for the <pid>.trace files written by reliable -T.
+ *
+ * usage: tracedump [-c conn] file.trace
+ *
+ * Prints one line per record: time in microseconds since the first
+ * record, connection, event, wire length, and ackno/seqno in host
+ * order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+static const char *const event_names[] = {
+  [TRACE_SEND] = "send",
+  [TRACE_RECV] = "recv",
+  [TRACE_RETRANSMIT] = "rexmit",
+  [TRACE_BAD_CKSUM] = "badcksum",
+  [TRACE_DUP] = "dup",
+  [TRACE_OUT_OF_WINDOW] = "outofwin",
+};
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-c conn] file.trace\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct trace_header h;
+  struct trace_rec r;
+  double scale;
+  uint64_t t0 = 0;
+  long conn = -1;
+  uint32_t i;
+  FILE *f;
+  int opt;
+
+  progname = "tracedump";
+  while ((opt = getopt (argc, argv, "c:")) != -1)
+    switch (opt) {
+    case 'c':
+      conn = atol (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind + 1 != argc)
+    usage ();
+
+  if (!(f = fopen (argv[optind], "r"))) {
+    perror (argv[optind]);
+    exit (1);
+  }
+  if (fread (&h, sizeof (h), 1, f) != 1 || memcmp (h.magic, "RTRC", 4)
+      || h.version != 1 || h.recsize != sizeof (r)) {
+    fprintf (stderr, "%s: not a version 1 trace file\n", argv[optind]);
+    exit (1);
+  }
+  scale = h.clock1 > h.clock0
+    ? (double) (h.mono1 - h.mono0) / (h.clock1 - h.clock0) : 1.0;
+
+  printf ("%14s %6s %-9s %5s %10s %10s\n",
+	  "usec", "conn", "event", "len", "ackno", "seqno");
+  for (i = 0; i < h.count && fread (&r, sizeof (r), 1, f) == 1; i++) {
+    const char *ev = r.event < sizeof (event_names) / sizeof (event_names[0])
+      && event_names[r.event] ? event_names[r.event] : "?";
+    if (i == 0)
+      t0 = r.time;
+    if (conn >= 0 && r.conn != conn)
+      continue;
+    printf ("%14.3f %6u %-9s ", ((int64_t) (r.time - t0)) * scale / 1e3,
+	    r.conn, ev);
+    if (r.len == 0xffff)
+      printf ("%5s\n", "err");
+    else if (r.len < 8)
+      printf ("%5u\n", r.len);
+    else if (r.len < 12)
+      printf ("%5u %10u\n", r.len, ntohl (r.ackno));
+    else
+      printf ("%5u %10u %10u\n", r.len, ntohl (r.ackno), ntohl (r.seqno));
+  }
+  if (i != h.count)
+    fprintf (stderr, "%s: truncated after %u of %u records\n",
+	     argv[optind], i, h.count);
+  return 0;
+}